@@ -1,42 +1,532 @@
 #ifndef RBTREE_H_
 #define RBTREE_H_
 
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <new>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
 #include <utility>
+#include <vector>
 
 #define THROW(str) std::string(str)
 #define __ inline
 
 enum Color { RED, BLACK };
 
-template <typename KeyType, typename DataType>
+// asks the cache for the line at address ahead of its use; does
+// nothing where the compiler has no prefetch builtin
+__ void _RBPrefetch(const void *address)
+{
+#if defined(__GNUC__) || defined(__clang__)
+  __builtin_prefetch(address);
+#else
+  (void)address;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////
+//| RBNodeArena
+//|
+//| Fixed-size block pool. Blocks are carved out of large chunks
+//| in address order, so nodes allocated one after another sit
+//| next to each other in memory. Freed blocks go to an intrusive
+//| free list and are handed out again before the chunk is bumped.
+//| The block size is bound by the first allocation; the arena is
+//| not thread safe.
+//////////////////////////////////////////////////////////////////
+class RBNodeArena {
+public:
+  RBNodeArena() :
+    free_(nullptr), chunks_(nullptr), next_(nullptr), end_(nullptr),
+    block_size_(0), block_align_(0), chunk_blocks_(kMinChunkBlocks)
+  { }
+
+  RBNodeArena(const RBNodeArena &) = delete;
+  RBNodeArena &operator=(const RBNodeArena &) = delete;
+
+  ~RBNodeArena()
+  { // gives every chunk back to the system
+    release();
+  }
+
+  bool fits(std::size_t size, std::size_t align) const
+  { // true if a block of (size, align) can be served by the pool
+    return block_size_ == 0 ||
+      (size <= block_size_ && align <= block_align_);
+  }
+
+  void *allocate(std::size_t size, std::size_t align)
+  { // hands out one block, binding the block size on first use
+    if (block_size_ == 0)
+      _Bind(size, align);
+
+    if (free_ != nullptr) {
+      _Free_block *block = free_;
+      free_ = block->next_;
+      return block;
+    }
+    if (next_ == end_)
+      _Grow();
+    void *block = next_;
+    next_ += block_size_;
+    return block;
+  }
+
+  void deallocate(void *block) noexcept
+  { // pushes the block onto the free list
+    _Free_block *freed = static_cast<_Free_block *>(block);
+    freed->next_ = free_;
+    free_ = freed;
+  }
+
+  void release() noexcept
+  { // frees all chunks at once, every block handed out is lost
+    while (chunks_ != nullptr) {
+      _Chunk *next = chunks_->next_;
+      ::operator delete(chunks_);
+      chunks_ = next;
+    }
+    free_ = nullptr;
+    next_ = end_ = nullptr;
+    chunk_blocks_ = kMinChunkBlocks;
+  }
+
+private:
+  static constexpr std::size_t kMinChunkBlocks = 64;
+  static constexpr std::size_t kMaxChunkBlocks = 4096;
+
+  struct _Free_block { _Free_block *next_; };
+  struct _Chunk { _Chunk *next_; };
+
+  void _Bind(std::size_t size, std::size_t align)
+  { // fixes the block geometry for the lifetime of the arena
+    block_align_ = align < alignof(_Free_block) ? alignof(_Free_block) : align;
+    if (size < sizeof(_Free_block))
+      size = sizeof(_Free_block);
+    block_size_ = (size + block_align_ - 1) / block_align_ * block_align_;
+  }
+
+  void _Grow()
+  { // allocates a new chunk, doubling the chunk size up to a cap
+    std::size_t header =
+      (sizeof(_Chunk) + block_align_ - 1) / block_align_ * block_align_;
+    std::size_t bytes = header + block_size_ * chunk_blocks_;
+    char *raw = static_cast<char *>(::operator new(bytes));
+    _Chunk *chunk = reinterpret_cast<_Chunk *>(raw);
+    chunk->next_ = chunks_;
+    chunks_ = chunk;
+    next_ = raw + header;
+    end_ = raw + bytes;
+    if (chunk_blocks_ < kMaxChunkBlocks)
+      chunk_blocks_ *= 2;
+  }
+
+  _Free_block *free_;
+  _Chunk *chunks_;
+  char *next_;
+  char *end_;
+  std::size_t block_size_;
+  std::size_t block_align_;
+  std::size_t chunk_blocks_;
+};
+
+//////////////////////////////////////////////////////////////////
+//| RBPoolAllocator
+//|
+//| std-compatible allocator over a shared RBNodeArena. Copies and
+//| rebinds share the arena, so the tree's node allocator draws
+//| from the pool its user allocator was created with. Copying a
+//| tree gives the copy a fresh pool. Requests that do not fit the
+//| pool (arrays, oversized types) fall back to operator new.
+//////////////////////////////////////////////////////////////////
+template <typename T>
+class RBPoolAllocator {
+  template <typename U> friend class RBPoolAllocator;
+public:
+  using value_type = T;
+  using propagate_on_container_copy_assignment = std::false_type;
+  using propagate_on_container_move_assignment = std::true_type;
+  using propagate_on_container_swap = std::true_type;
+
+  RBPoolAllocator() :
+    arena_(std::make_shared<RBNodeArena>())
+  { }
+
+  // no move constructor: a moved-from allocator keeps its arena,
+  // so a moved-from tree can still allocate
+  RBPoolAllocator(const RBPoolAllocator &rhs) noexcept = default;
+  RBPoolAllocator &operator=(const RBPoolAllocator &rhs) noexcept = default;
+
+  template <typename U>
+  RBPoolAllocator(const RBPoolAllocator<U> &rhs) noexcept :
+    arena_(rhs.arena_)
+  { }
+
+  T *allocate(std::size_t n)
+  {
+    if (n == 1 && arena_->fits(sizeof(T), alignof(T)))
+      return static_cast<T *>(arena_->allocate(sizeof(T), alignof(T)));
+    return static_cast<T *>(::operator new(n * sizeof(T)));
+  }
+
+  void deallocate(T *p, std::size_t n) noexcept
+  {
+    if (n == 1 && arena_->fits(sizeof(T), alignof(T)))
+      arena_->deallocate(p);
+    else
+      ::operator delete(p);
+  }
+
+  RBPoolAllocator select_on_container_copy_construction() const
+  { // a copied tree gets its own pool
+    return RBPoolAllocator();
+  }
+
+  bool _Exclusive() const noexcept
+  { // true if this is the only handle on the arena
+    return arena_.use_count() == 1;
+  }
+
+  void _Release_all() noexcept
+  { // drops every block at once, see RBNodeArena::release
+    arena_->release();
+  }
+
+  template <typename U>
+  bool operator==(const RBPoolAllocator<U> &rhs) const noexcept
+  { return arena_ == rhs.arena_; }
+
+  template <typename U>
+  bool operator!=(const RBPoolAllocator<U> &rhs) const noexcept
+  { return arena_ != rhs.arena_; }
+
+private:
+  std::shared_ptr<RBNodeArena> arena_;
+};
+
+struct RBTreeTraits;
+
+//////////////////////////////////////////////////////////////////
+//| Aggregate policies
+//|
+//| a policy keeps a monoid of the elements of every subtree in its
+//| root node, so RBTree::aggregate(lo, hi) runs in O(log n):
+//|   value_type                    the aggregate
+//|   identity()                    neutral element
+//|   lift(key, data)               aggregate of a single element
+//|   combine(a, b)                 a then b, must be associative
+//| set it as RBTreeTraits::aggregate.
+//////////////////////////////////////////////////////////////////
+struct RBNoAggregate { };
+
+template <typename T>
+struct RBSumAggregate {
+  using value_type = T;
+
+  static value_type identity()
+  { return value_type(); }
+
+  template <typename K, typename D>
+  static value_type lift(const K &, const D &data)
+  { return data; }
+
+  static value_type combine(const value_type &a, const value_type &b)
+  { return a + b; }
+};
+
+template <typename T>
+struct RBMinAggregate {
+  using value_type = T;
+
+  static value_type identity()
+  { return std::numeric_limits<T>::max(); }
+
+  template <typename K, typename D>
+  static value_type lift(const K &, const D &data)
+  { return data; }
+
+  static value_type combine(const value_type &a, const value_type &b)
+  { return b < a ? b : a; }
+};
+
+template <typename T>
+struct RBMaxAggregate {
+  using value_type = T;
+
+  static value_type identity()
+  { return std::numeric_limits<T>::lowest(); }
+
+  template <typename K, typename D>
+  static value_type lift(const K &, const D &data)
+  { return data; }
+
+  static value_type combine(const value_type &a, const value_type &b)
+  { return a < b ? b : a; }
+};
+
+//////////////////////////////////////////////////////////////////
+//| RBIntervalAggregate
+//|
+//| keys are closed intervals std::pair<T, T>(low, high), ordered
+//| by low; a node keeps the largest high of its subtree so that
+//| RBTree::overlapping and any_overlap can skip whole subtrees
+//////////////////////////////////////////////////////////////////
+template <typename T>
+struct RBIntervalAggregate {
+  using value_type = T;
+
+  static value_type identity()
+  { return std::numeric_limits<T>::lowest(); }
+
+  template <typename D>
+  static value_type lift(const std::pair<T, T> &interval, const D &)
+  { return interval.second; }
+
+  static value_type combine(const value_type &a, const value_type &b)
+  { return a < b ? b : a; }
+};
+
+template <typename Policy>
+struct _Is_interval_aggregate : std::false_type { };
+
+template <typename T>
+struct _Is_interval_aggregate<RBIntervalAggregate<T>> : std::true_type { };
+
+// tag selecting the RBTree constructor that bulk loads a sorted range
+struct RBSortedRangeTag {
+  explicit RBSortedRangeTag() = default;
+};
+constexpr RBSortedRangeTag RBSortedRange{};
+
+template <typename KeyType, typename DataType,
+  typename Compare = std::less<KeyType>,
+  typename Allocator = std::allocator<std::pair<const KeyType, DataType>>,
+  typename Traits = RBTreeTraits>
 class RBTree;
-template <typename KeyType, typename DataType>
+
+// read-optimized copy made by RBTree::freeze, see rbtree_frozen.h
+template <typename KeyType, typename DataType,
+  typename Compare = std::less<KeyType>>
+class FrozenRBTree;
+
+//////////////////////////////////////////////////////////////////
+//| _Three_way_comparable
+//|
+//| true if ordering Key against K with Compare can be done with
+//| one key.compare(node_key) call instead of two Compare calls.
+//| This holds only for std::less over std::basic_string and
+//| std::basic_string_view with the standard char traits, whose
+//| compare() is known to agree with operator<; other types with
+//| a compare() member keep the two Compare calls.
+//////////////////////////////////////////////////////////////////
+template <typename Compare, typename Key>
+struct _Is_std_less : std::false_type { };
+
+template <typename Key>
+struct _Is_std_less<std::less<Key>, Key> : std::true_type { };
+
+template <typename Key>
+struct _Is_std_less<std::less<void>, Key> : std::true_type { };
+
+// character type of a standard string or string view, else void
+template <typename T>
+struct _Std_string_char { using type = void; };
+
+template <typename C, typename A>
+struct _Std_string_char<std::basic_string<C, std::char_traits<C>, A>>
+{ using type = C; };
+
+template <typename C>
+struct _Std_string_char<std::basic_string_view<C, std::char_traits<C>>>
+{ using type = C; };
+
+template <typename Compare, typename Key, typename K>
+struct _Three_way_comparable : std::integral_constant<bool,
+  _Is_std_less<Compare, Key>::value &&
+  !std::is_void<typename _Std_string_char<Key>::type>::value &&
+  std::is_same<typename _Std_string_char<Key>::type,
+    typename _Std_string_char<K>::type>::value> { };
+
+//////////////////////////////////////////////////////////////////
+//| RBTreeTraits
+//|
+//| Compile-time options of RBNode and RBTree. Derive from it and
+//| override the members you need:
+//|   struct MyTraits : RBTreeTraits
+//|   { static constexpr bool compact_color = true; };
+//////////////////////////////////////////////////////////////////
+struct RBTreeTraits {
+  // keep the color in the low bit of the parent pointer instead
+  // of a separate field, saving one word per node
+  static constexpr bool compact_color = false;
+
+  // reject an insert whose key is already in the tree; insert and
+  // emplace then return (iterator, inserted) like std::map
+  static constexpr bool unique_keys = false;
+
+  // keep the subtree size in every node, enabling select, rank,
+  // count_in_range and O(log n) iterator jumps
+  static constexpr bool order_statistics = false;
+
+  // aggregate policy kept in every node, e.g. RBSumAggregate<long>
+  using aggregate = RBNoAggregate;
+};
+
+struct RBCompactTraits : RBTreeTraits {
+  static constexpr bool compact_color = true;
+};
+
+template <typename T>
+struct RBIntervalTraits : RBTreeTraits {
+  using aggregate = RBIntervalAggregate<T>;
+};
+
+// interval tree over closed intervals [low, high] of T:
+//   RBIntervalTree<int, std::string> tree;
+//   tree.insert({3, 8}, "a");
+//   tree.overlapping(5, 6, fn);
+template <typename T, typename DataType,
+  typename Allocator = std::allocator<std::pair<const std::pair<T, T>, DataType>>>
+using RBIntervalTree = RBTree<std::pair<T, T>, DataType,
+  std::less<std::pair<T, T>>, Allocator, RBIntervalTraits<T>>;
+
+template <typename KeyType, typename DataType, typename Traits = RBTreeTraits>
 class _const_Tree_Iterator;
-template <typename KeyType, typename DataType>
+template <typename KeyType, typename DataType, typename Traits = RBTreeTraits>
 class _Tree_Iterator;
 
-template <typename KeyType, typename DataType>
-class RBNode {
-  friend class RBTree<KeyType, DataType>;
-  friend class _const_Tree_Iterator<KeyType, DataType>;
-  friend class _Tree_Iterator<KeyType, DataType>;
+//////////////////////////////////////////////////////////////////
+//| _RBNode_parent
+//|
+//| parent link and color of a node. The compact form packs the
+//| color into bit 0 of the parent address, which is always clear
+//| since nodes are at least pointer aligned.
+//////////////////////////////////////////////////////////////////
+template <typename Node, bool Compact>
+class _RBNode_parent {
+public:
+  _RBNode_parent(Node *parent, Color color) :
+    parent_(parent), color_(color)
+  { }
+
+  Node *_Ptr() const
+  { return parent_; }
+
+  void _Set_ptr(Node *parent)
+  { parent_ = parent; }
+
+  Color _Color() const
+  { return color_; }
+
+  void _Set_color(Color color)
+  { color_ = color; }
+
+private:
+  Node *parent_;
+  Color color_;
+};
+
+template <typename Node>
+class _RBNode_parent<Node, true> {
+public:
+  _RBNode_parent(Node *parent, Color color) :
+    bits_(reinterpret_cast<std::uintptr_t>(parent) | color)
+  { }
+
+  Node *_Ptr() const
+  { return reinterpret_cast<Node *>(bits_ & ~kColorBit); }
+
+  void _Set_ptr(Node *parent)
+  { bits_ = reinterpret_cast<std::uintptr_t>(parent) | (bits_ & kColorBit); }
+
+  Color _Color() const
+  { return static_cast<Color>(bits_ & kColorBit); }
+
+  void _Set_color(Color color)
+  { bits_ = (bits_ & ~kColorBit) | color; }
+
+private:
+  static constexpr std::uintptr_t kColorBit = 1;
+  std::uintptr_t bits_;
+};
+
+//////////////////////////////////////////////////////////////////
+//| _RBNode_count
+//|
+//| subtree size of a node when order statistics are enabled; the
+//| empty specialization is a base class, so it takes no space
+//////////////////////////////////////////////////////////////////
+template <bool Enabled>
+class _RBNode_count {
+public:
+  std::size_t count_ = 1;
+};
+
+template <>
+class _RBNode_count<false> { };
+
+//////////////////////////////////////////////////////////////////
+//| _RBNode_aggregate
+//|
+//| aggregate of the subtree rooted at a node, empty without policy
+//////////////////////////////////////////////////////////////////
+template <typename Policy>
+class _RBNode_aggregate {
+public:
+  typename Policy::value_type agg_;
+};
+
+template <>
+class _RBNode_aggregate<RBNoAggregate> { };
+
+// fields are ordered so the child links, the parent/color word and
+// the key come first and share a cache line during descent
+template <typename KeyType, typename DataType, typename Traits = RBTreeTraits>
+class RBNode : private _RBNode_count<Traits::order_statistics>,
+  private _RBNode_aggregate<typename Traits::aggregate> {
+  template <typename, typename, typename, typename, typename>
+  friend class RBTree;
+  friend class _const_Tree_Iterator<KeyType, DataType, Traits>;
+  friend class _Tree_Iterator<KeyType, DataType, Traits>;
 public:
 
-	RBNode(const KeyType key, const DataType data) :
-		key_(key), data_(data), parent_{ nullptr },
-		left_(nullptr), right_(nullptr), color_(RED)
+	template <typename K, typename D>
+	RBNode(K &&key, D &&data) :
+		left_(nullptr), right_(nullptr), parent_(nullptr, RED),
+		key_(std::forward<K>(key)), data_(std::forward<D>(data))
 	{ }
 
-	RBNode(const KeyType key, const DataType data,
+	template <typename... KArgs, typename... DArgs>
+	RBNode(std::piecewise_construct_t,
+		std::tuple<KArgs...> key, std::tuple<DArgs...> data) :
+		left_(nullptr), right_(nullptr), parent_(nullptr, RED),
+		key_(std::make_from_tuple<KeyType>(std::move(key))),
+		data_(std::make_from_tuple<DataType>(std::move(data)))
+	{ // constructs key and data in place from their argument tuples
+	}
+
+	RBNode(const KeyType &key, const DataType &data,
 		RBNode *left, RBNode *right, RBNode *parent) :
-		key_(key), data_(data), left_(left),
-		right_(right), parent_(parent), color_(RED)
+		left_(left), right_(right), parent_(parent, RED),
+		key_(key), data_(data)
 	{ }
 
 	RBNode(const RBNode& node) :
-		key_(node.key_), data_(node.data_), left_(node.left_),
-		right_(node.right_), parent_(node.parent_), color_(RED)
+		left_(node.left_), right_(node.right_),
+		parent_(node.parent_._Ptr(), RED),
+		key_(node.key_), data_(node.data_)
 	{ }
 
 	RBNode & operator=(const RBNode &node) {
@@ -45,16 +535,12 @@ public:
 		left_ = node.left_;
 		right_ = node.right_;
 		parent_ = node.parent_;
-		color_ = node.color_;
 		return *this;
 	}
 
 	RBNode() :
-		key_(), data_(), left_(nullptr),
-    right_(nullptr), parent_(nullptr)
-	{ }
-
-	~RBNode()
+		left_(nullptr), right_(nullptr), parent_(nullptr, RED),
+		key_(), data_()
 	{ }
 
   KeyType &Key() {
@@ -65,57 +551,102 @@ public:
     return key_;
   }
 
+  DataType &Data() {
+    return data_;
+  }
+
+  const DataType &Data() const {
+    return data_;
+  }
+
 private:
-	RBNode *parent_;
 	RBNode *left_;
 	RBNode *right_;
+	_RBNode_parent<RBNode, Traits::compact_color> parent_;
 	KeyType key_;
 	DataType data_;
-	Color color_;
 };
- 
-template <typename KeyType, typename DataType>
+
+// sizeof(RBNode) for a key, data and traits combination; check it
+// directly where a layout matters, e.g.
+//   static_assert(RBNodeSize<int, int, RBCompactTraits> <= 32, "");
+template <typename KeyType, typename DataType, typename Traits = RBTreeTraits>
+constexpr std::size_t RBNodeSize = sizeof(RBNode<KeyType, DataType, Traits>);
+
+// prints sizeof(RBNode) while compiling, without failing the build.
+// Calling a [[deprecated]] function makes the compiler warn, and the
+// warning shows the template argument: for 32-byte nodes it names
+//   _RBNode_size_report() [with ... Size = 32]
+template <std::size_t Size>
+[[deprecated("RBNode size report")]] constexpr bool _RBNode_size_report()
+{ return true; }
+
+#define RBTREE_REPORT_NODE_SIZE(KeyType, DataType, Traits) \
+  static_assert(_RBNode_size_report<RBNodeSize<KeyType, DataType, Traits>>(), "")
+
+//////////////////////////////////////////////////////////////////
+//| _RBTree_header
+//|
+//| leftmost and rightmost nodes of a tree, kept up to date by
+//| RBTree so begin() and the maximum are O(1). Iterators point to
+//| it so that end() can be decremented.
+//////////////////////////////////////////////////////////////////
+template <typename Node>
+struct _RBTree_header {
+  Node *leftmost_ = nullptr;
+  Node *rightmost_ = nullptr;
+};
+
+template <typename KeyType, typename DataType, typename Traits>
 class _const_Tree_Iterator {
 public:
-  using pointer = typename RBNode<KeyType, DataType>*;
-  using NodeType = typename RBNode<KeyType, DataType>;
-
-  _const_Tree_Iterator(RBNode<KeyType, DataType> *ptr) :
-    ptr_(ptr)
+  using pointer = RBNode<KeyType, DataType, Traits>*;
+  using NodeType = RBNode<KeyType, DataType, Traits>;
+  using header_type = _RBTree_header<NodeType>;
+
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = NodeType;
+  using difference_type = std::ptrdiff_t;
+  using reference = const NodeType &;
+
+  _const_Tree_Iterator(RBNode<KeyType, DataType, Traits> *ptr,
+    const header_type *header = nullptr) :
+    ptr_(ptr), header_(header)
   { }
 
   _const_Tree_Iterator(const _const_Tree_Iterator &rhs) :
-    ptr_(rhs.ptr_)
+    ptr_(rhs.ptr_), header_(rhs.header_)
   { }
 
   _const_Tree_Iterator() :
-    ptr_(nullptr)
+    ptr_(nullptr), header_(nullptr)
   { }
 
-  _const_Tree_Iterator<KeyType, DataType>
-    operator=(const _const_Tree_Iterator<KeyType, DataType> &rhs)
+  _const_Tree_Iterator<KeyType, DataType, Traits>
+    operator=(const _const_Tree_Iterator<KeyType, DataType, Traits> &rhs)
   {
     ptr_ = rhs.ptr_;
+    header_ = rhs.header_;
     return *this;
   }
 
-  const pointer operator->()
+  pointer operator->() const
   {
     return this->ptr_;
   }
 
-  const RBNode<KeyType, DataType> &operator*()
+  const RBNode<KeyType, DataType, Traits> &operator*() const
   {
     return *(this->ptr_);
   }
 
-  _const_Tree_Iterator<KeyType, DataType> operator++()
+  _const_Tree_Iterator<KeyType, DataType, Traits> operator++()
   { // increments the iterator
     pointer parent = nullptr;
     if (IsNil(ptr_))
       ;
     else if (!IsNil(Right(ptr_))) {
-      RBNode<KeyType, DataType> *min = _Min(Right(ptr_));
+      RBNode<KeyType, DataType, Traits> *min = _Min(Right(ptr_));
       ptr_ = min;
     }
     else if (!IsNil(parent = Parent(ptr_)))
@@ -131,46 +662,49 @@ public:
   }
 
   _const_Tree_Iterator operator++(int)
-  { // post-increment
-    pointer Old = (*this).ptr_;
+  { // post-increment; the copy keeps the header, so it can still
+    // be decremented from end()
+    _const_Tree_Iterator old = *this;
     ++(*this);
-    return _const_Tree_Iterator<KeyType, DataType>(Old);
+    return old;
   }
 
-  _const_Tree_Iterator<KeyType, DataType> operator--()
+  _const_Tree_Iterator<KeyType, DataType, Traits> operator--()
   { // pre-decrement
     pointer parent = nullptr;
     if (IsNil(ptr_))
-    { // if ptr_ is end()
- 
+    { // if ptr_ is end(), step to the maximum
+      if (header_ != nullptr)
+        ptr_ = header_->rightmost_;
     }
     else if (!IsNil(Left(ptr_))) 
     { // set ptr to left-subtree of ptr
       ptr_ = _Max(Left(ptr_));
     }
-    else if (!IsNil(Parent(ptr_)))
-    { // go up to find right subtree
-      while (!IsNil(Left(parent = Parent(ptr_)))
+    else
+    { // go up to find right subtree; from the minimum this ends at
+      // nil, so begin() steps to end() as the maximum steps forward
+      while (!IsNil(parent = Parent(ptr_))
         && (ptr_ == Left(parent)))
         ptr_ = parent;
+      ptr_ = parent;
     }
-    else
-      ;// throw THROW("iterator out of range");
+    return *this;
   }
 
-  _const_Tree_Iterator<KeyType, DataType> operator--(int)
+  _const_Tree_Iterator<KeyType, DataType, Traits> operator--(int)
   { // post-decrement
-    pointer Old = (*this).ptr_;
+    _const_Tree_Iterator old = *this;
     --(*this);
-    return _const_Tree_Iterator<KeyType, DataType>(Old);
+    return old;
   }
 
-  bool operator==(const _const_Tree_Iterator<KeyType, DataType> &rhs)
+  bool operator==(const _const_Tree_Iterator<KeyType, DataType, Traits> &rhs) const
   {
     return this->ptr_ == rhs.ptr_;
   }
 
-  bool operator!=(const _const_Tree_Iterator<KeyType, DataType> &rhs)
+  bool operator!=(const _const_Tree_Iterator<KeyType, DataType, Traits> &rhs) const
   {
     return this->ptr_ != rhs.ptr_;
   }
@@ -200,26 +734,26 @@ private:
     return parent;
   }
 
-  __ pointer& Parent(pointer &node) const
+  __ pointer Parent(const pointer &node) const
   { // get the parent of the node
-    return node->parent_;
+    return node->parent_._Ptr();
   }
 
-  __ pointer& Left(pointer &node) const
+  __ pointer& Left(const pointer &node) const
   { // get the left child of the node
     return node->left_;
   }
 
-  __ pointer& Right(pointer &node)
+  __ pointer& Right(const pointer &node) const
   { // get the roght child of the node
     return node->right_;
   }
 
   // as described in CLRS, we consider the null nodes
   // as nil[T] and color of these nodes is black
-  __ Color _Color(pointer &node)
+  __ Color _Color(const pointer &node) const
   { // get the color of the node
-    return !IsNil(node) ? node->color_ : Color::BLACK;
+    return !IsNil(node) ? node->parent_._Color() : Color::BLACK;
   }
 
   __ KeyType &Key(pointer &node) const
@@ -227,54 +761,64 @@ private:
     return node->key_;
   }
 
-  __ bool IsNil(pointer &node) const
+  __ bool IsNil(const pointer &node) const
   { // returns true if node is nullptr
     return node == nullptr;
   }
-  RBNode<KeyType, DataType> *ptr_;
+  RBNode<KeyType, DataType, Traits> *ptr_;
+  const header_type *header_;
 };
 
-template <typename KeyType, typename DataType>
+template <typename KeyType, typename DataType, typename Traits>
 class _Tree_Iterator {
-  using pointer =  typename RBNode<KeyType, DataType>*;
-  using NodeType = typename RBNode<KeyType, DataType>;
 public:
-  _Tree_Iterator(RBNode<KeyType, DataType> *ptr) :
-    ptr_(ptr)
+  using pointer = RBNode<KeyType, DataType, Traits>*;
+  using NodeType = RBNode<KeyType, DataType, Traits>;
+  using header_type = _RBTree_header<NodeType>;
+
+  using iterator_category = std::bidirectional_iterator_tag;
+  using value_type = NodeType;
+  using difference_type = std::ptrdiff_t;
+  using reference = NodeType &;
+
+  _Tree_Iterator(RBNode<KeyType, DataType, Traits> *ptr,
+    const header_type *header = nullptr) :
+    ptr_(ptr), header_(header)
   { }
 
   _Tree_Iterator(const _Tree_Iterator &rhs) :
-    ptr_(rhs.ptr_)
+    ptr_(rhs.ptr_), header_(rhs.header_)
   { }
 
   _Tree_Iterator() :
-    ptr_(nullptr)
+    ptr_(nullptr), header_(nullptr)
   { }
 
-  _Tree_Iterator<KeyType, DataType>
-    operator=(const _Tree_Iterator<KeyType, DataType> &rhs)
+  _Tree_Iterator<KeyType, DataType, Traits>
+    operator=(const _Tree_Iterator<KeyType, DataType, Traits> &rhs)
   {
     ptr_ = rhs.ptr_;
+    header_ = rhs.header_;
     return *this;
   }
 
-  pointer *operator->()
+  pointer operator->() const
   {
     return this->ptr_;
   }
 
-  RBNode<KeyType, DataType> &operator*()
+  RBNode<KeyType, DataType, Traits> &operator*() const
   {
     return *(this->ptr_);
   }
 
-  _Tree_Iterator<KeyType, DataType> operator++()
+  _Tree_Iterator<KeyType, DataType, Traits> operator++()
   { // increments the iterator
     pointer parent = nullptr;
     if (IsNil(ptr_))
       ;
     else if (!IsNil(Right(ptr_))) {
-      RBNode<KeyType, DataType> *min = _Min(Right(ptr_));
+      RBNode<KeyType, DataType, Traits> *min = _Min(Right(ptr_));
       ptr_ = min;
     }
     else if (!IsNil(parent = Parent(ptr_)))
@@ -290,62 +834,110 @@ public:
   }
 
   _Tree_Iterator operator++(int)
-  { // post-increment
-    pointer Old = (*this).ptr_;
+  { // post-increment; the copy keeps the header, so it can still
+    // be decremented from end()
+    _Tree_Iterator old = *this;
     ++(*this);
-    return _Tree_Iterator<KeyType, DataType>(Old);
+    return old;
   }
 
-  _Tree_Iterator<KeyType, DataType> operator--()
+  _Tree_Iterator<KeyType, DataType, Traits> operator--()
   { // pre-decrement
     pointer parent = nullptr;
     if (IsNil(ptr_))
-    { // if ptr_ is end()
-
+    { // if ptr_ is end(), step to the maximum
+      if (header_ != nullptr)
+        ptr_ = header_->rightmost_;
     }
     else if (!IsNil(Left(ptr_)))
     { // set ptr to left-subtree of ptr
       ptr_ = _Max(Left(ptr_));
     }
-    else if (!IsNil(Parent(ptr_)))
-    { // go up to find right subtree
-      while (!IsNil(Left(parent = Parent(ptr_)))
+    else
+    { // go up to find right subtree; from the minimum this ends at
+      // nil, so begin() steps to end() as the maximum steps forward
+      while (!IsNil(parent = Parent(ptr_))
         && (ptr_ == Left(parent)))
         ptr_ = parent;
+      ptr_ = parent;
     }
-    else
-      throw THROW("iterator out of range");
+    return *this;
   }
 
-  _Tree_Iterator<KeyType, DataType> operator--(int)
+  _Tree_Iterator<KeyType, DataType, Traits> operator--(int)
   { // post-decrement
-    pointer Old = (*this).ptr_;
+    _Tree_Iterator old = *this;
     --(*this);
-    return _Tree_Iterator<KeyType, DataType>(Old);
+    return old;
   }
 
-  _Tree_Iterator operator+(size_t Off)
-  { // move the iterator by Off
-    while (Off-- > 0)
-      ++(*this);
+  _Tree_Iterator &operator+=(size_t Off)
+  { // move the iterator by Off, in O(log n) with order statistics
+    if constexpr (Traits::order_statistics)
+      ptr_ = _Advance(ptr_, Off);
+    else
+      while (Off-- > 0)
+        ++(*this);
+    return *this;
+  }
+
+  _Tree_Iterator operator+(size_t Off) const
+  { // iterator Off elements further
+    _Tree_Iterator moved(*this);
+    moved += Off;
+    return moved;
   }
 
-  bool operator==(const _Tree_Iterator<KeyType, DataType> &rhs)
+  bool operator==(const _Tree_Iterator<KeyType, DataType, Traits> &rhs) const
   {
     return this->ptr_ == rhs.ptr_;
   }
 
-  bool operator!=(const _Tree_Iterator<KeyType, DataType> &rhs)
+  bool operator!=(const _Tree_Iterator<KeyType, DataType, Traits> &rhs) const
   {
     return this->ptr_ != rhs.ptr_;
   }
 
 
-  RBNode<KeyType, DataType> * _Ptr()
+  RBNode<KeyType, DataType, Traits> * _Ptr()
   {
     return this->ptr_;
   }
 private:
+  pointer _Advance(pointer node, size_t Off) const
+  { // Off-th successor of node using subtree sizes: either it is
+    // inside the right subtree, or the right subtree is skipped
+    // and the walk continues from the next ancestor to the right
+    while (Off > 0 && !IsNil(node)) {
+      size_t right = IsNil(Right(node)) ? 0 : Right(node)->count_;
+      if (Off <= right)
+      { // select the (Off - 1)-th node of the right subtree
+        node = Right(node);
+        Off -= 1;
+        for (;;) {
+          size_t left = IsNil(Left(node)) ? 0 : Left(node)->count_;
+          if (Off < left)
+            node = Left(node);
+          else if (Off == left)
+            return node;
+          else {
+            Off -= left + 1;
+            node = Right(node);
+          }
+        }
+      }
+      Off -= right;
+      pointer parent = Parent(node);
+      while (!IsNil(parent) && node == Right(parent)) {
+        node = parent;
+        parent = Parent(node);
+      }
+      node = parent;
+      Off -= 1;
+    }
+    return node;
+  }
+
   __ pointer _Min(pointer node) const
   { // returns minimum of the tree
     pointer parent = nullptr;
@@ -370,26 +962,26 @@ private:
     return parent;
   }
 
-  __ pointer& Parent(pointer &node) const
+  __ pointer Parent(const pointer &node) const
   { // get the parent of the node
-    return node->parent_;
+    return node->parent_._Ptr();
   }
 
-  __ pointer& Left(pointer &node) const
+  __ pointer& Left(const pointer &node) const
   { // get the left child of the node
     return node->left_;
   }
 
-  __ pointer& Right(pointer &node)
+  __ pointer& Right(const pointer &node) const
   { // get the roght child of the node
     return node->right_;
   }
 
   // as described in CLRS, we consider the null nodes
   // as nil[T] and color of these nodes is black
-  __ Color _Color(pointer &node)
+  __ Color _Color(const pointer &node) const
   { // get the color of the node
-    return !IsNil(node) ? node->color_ : Color::BLACK;
+    return !IsNil(node) ? node->parent_._Color() : Color::BLACK;
   }
 
   __ KeyType &Key(pointer &node) const
@@ -397,47 +989,181 @@ private:
     return node->key_;
   }
 
-  __ bool IsNil(pointer &node) const
+  __ bool IsNil(const pointer &node) const
   { // returns true if node is nullptr
     return node == nullptr;
   }
 
-  RBNode<KeyType, DataType> *ptr_;
+  RBNode<KeyType, DataType, Traits> *ptr_;
+  const header_type *header_;
 };
 
-template <typename KeyType, typename DataType>
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator, typename Traits>
 class RBTree {
 public:
-  using pointer = RBNode<KeyType, DataType>*;
+  using pointer = RBNode<KeyType, DataType, Traits>*;
   using pair = std::pair<KeyType, DataType>&;
-  using NodeType = typename RBNode<KeyType, DataType>;
+  using NodeType = RBNode<KeyType, DataType, Traits>;
   using size_type = unsigned int;
-  using const_iterator =
-    typename _const_Tree_Iterator<KeyType, DataType>;
-  using iterator =
-    typename _Tree_Iterator<KeyType, DataType>;
+  using key_compare = Compare;
+  using allocator_type = Allocator;
+  using const_iterator = _const_Tree_Iterator<KeyType, DataType, Traits>;
+  using iterator = _Tree_Iterator<KeyType, DataType, Traits>;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using const_reverse_iterator = std::reverse_iterator<const_iterator>;
+
+  using traits_type = Traits;
+
+  // insert and emplace report whether they inserted when keys are unique
+  using insert_return_type = std::conditional_t<Traits::unique_keys,
+    std::pair<iterator, bool>, iterator>;
+
+  // bytes taken by one node, see RBTREE_REPORT_NODE_SIZE
+  static constexpr std::size_t node_size = sizeof(NodeType);
+
+  class _Aggregate_data_ref;
+
+  // operator[] returns a proxy refreshing the aggregates on writes
+  // when the traits have an aggregate policy, DataType& otherwise
+  using data_reference = std::conditional_t<
+    std::is_same<typename Traits::aggregate, RBNoAggregate>::value,
+    DataType &, _Aggregate_data_ref>;
+
+  class _Aggregate_data_ref {
+  public:
+    _Aggregate_data_ref(RBTree *tree, pointer node) :
+      tree_(tree), node_(node)
+    { }
+
+    operator const DataType &() const
+    { return node_->data_; }
+
+    const DataType &get() const
+    { return node_->data_; }
+
+    template <typename D>
+    _Aggregate_data_ref &operator=(D &&data)
+    {
+      node_->data_ = std::forward<D>(data);
+      tree_->_Update_path(node_);
+      return *this;
+    }
+
+    template <typename D>
+    _Aggregate_data_ref &operator+=(const D &data)
+    {
+      node_->data_ += data;
+      tree_->_Update_path(node_);
+      return *this;
+    }
+
+    template <typename D>
+    _Aggregate_data_ref &operator-=(const D &data)
+    {
+      node_->data_ -= data;
+      tree_->_Update_path(node_);
+      return *this;
+    }
+
+  private:
+    RBTree *tree_;
+    pointer node_;
+  };
+
+private:
+  using node_allocator = typename std::allocator_traits<Allocator>::
+    template rebind_alloc<NodeType>;
+  using node_traits = std::allocator_traits<node_allocator>;
 
 public:
   RBTree() :
-    root_(nullptr), size_(0)
+    root_(nullptr), size_(0), comp_(), alloc_()
+  { }
+
+  explicit RBTree(const Compare &comp,
+    const Allocator &alloc = Allocator()) :
+    root_(nullptr), size_(0), comp_(comp), alloc_(alloc)
+  { }
+
+  explicit RBTree(const Allocator &alloc) :
+    root_(nullptr), size_(0), comp_(), alloc_(alloc)
   { }
 
-  RBTree(const RBTree<KeyType, DataType> &rhs) :
-    size_(0), root_(nullptr)
+  RBTree(const RBTree &rhs) :
+    root_(nullptr), size_(0), comp_(rhs.comp_),
+    alloc_(node_traits::select_on_container_copy_construction(rhs.alloc_))
   { // copy from another tree
-    if (!empty())
-      clear();
-    _Clone(rhs.cbegin(), rhs.cend());
-    
+    _Clone(rhs);
   }
 
-  RBTree& operator=(const RBTree<KeyType, DataType> &rhs)
+  RBTree& operator=(const RBTree &rhs)
   { // assigns one tree to another
-    if ((*this) != rhs) {
+    if (this != &rhs) {
       if (!empty())
         clear();
-      _Clone(rhs.cbegin(), rhs.cend())
+      if (node_traits::propagate_on_container_copy_assignment::value)
+        alloc_ = rhs.alloc_;
+      comp_ = rhs.comp_;
+      _Clone(rhs);
+    }
+    return *this;
+  }
+
+  template <typename InputIt>
+  RBTree(RBSortedRangeTag, InputIt first, InputIt last,
+    const Compare &comp = Compare(), const Allocator &alloc = Allocator()) :
+    root_(nullptr), size_(0), comp_(comp), alloc_(alloc)
+  { // builds the tree from a sorted range in O(n)
+    assign_sorted(first, last);
+  }
+
+  RBTree(RBTree &&rhs) noexcept :
+    root_(rhs.root_), size_(rhs.size_), comp_(rhs.comp_), alloc_(rhs.alloc_),
+    header_(rhs.header_)
+  { // steals the nodes of rhs in O(1)
+    rhs.root_ = nullptr;
+    rhs.size_ = 0;
+    rhs.header_ = _RBTree_header<NodeType>();
+  }
+
+  RBTree& operator=(RBTree &&rhs)
+  { // move assigns, stealing the nodes when allocators allow it
+    if (this != &rhs) {
+      clear();
+      comp_ = rhs.comp_;
+      if (node_traits::propagate_on_container_move_assignment::value ||
+        alloc_ == rhs.alloc_) {
+        if (node_traits::propagate_on_container_move_assignment::value)
+          alloc_ = rhs.alloc_;
+        root_ = rhs.root_;
+        size_ = rhs.size_;
+        header_ = rhs.header_;
+        rhs.root_ = nullptr;
+        rhs.size_ = 0;
+        rhs.header_ = _RBTree_header<NodeType>();
+      }
+      else
+      { // nodes can't change allocators, move the elements instead
+        if (!IsNil(rhs.root_))
+          root_ = _Copy_subtree<true>(rhs.root_, nullptr);
+        size_ = rhs.size();
+        _Reset_ends();
+        rhs.clear();
+      }
     }
+    return *this;
+  }
+
+  void swap(RBTree &rhs) noexcept
+  { // swaps the contents of two trees in O(1)
+    using std::swap;
+    swap(root_, rhs.root_);
+    swap(size_, rhs.size_);
+    swap(header_, rhs.header_);
+    swap(comp_, rhs.comp_);
+    if (node_traits::propagate_on_container_swap::value)
+      swap(alloc_, rhs.alloc_);
   }
 
   ~RBTree()
@@ -447,52 +1173,173 @@ public:
   }
 
   // true if empty
-  bool empty()
-  { return !size(); }
+  bool empty() const
+  { return IsNil(root_); }
+
+  allocator_type get_allocator() const
+  { return allocator_type(alloc_); }
+
+  key_compare key_comp() const
+  { return comp_; }
 
   // returns the number of nodes
-  size_type size() 
+  size_type size() const
   { return size_; }
 
-  iterator insert(const KeyType &key, const DataType &data)
+  insert_return_type insert(const KeyType &key, const DataType &data)
   { // inserts key with data to the tree
-    pointer node =
-      new RBNode<KeyType, DataType>(key, data);
-    root_ = _Insert(root_, node);
-    return iterator(node);
+    return _Emplace_key(key, key, data);
   }  
 
-  iterator insert(const std::pair<KeyType, DataType> &p)
+  insert_return_type insert(const std::pair<KeyType, DataType> &p)
   {
-    pointer node = new RBNode<KeyType, DataType>(p.first, p.second);
-    root_ = _Insert(root_, node);
-    return iterator(node);
+    return _Emplace_key(p.first, p.first, p.second);
+  }
+
+  insert_return_type insert(std::pair<KeyType, DataType> &&p)
+  { // moves key and data of p into the new node
+    return _Emplace_key(p.first, std::move(p.first), std::move(p.second));
+  }
+
+  template <typename... Args>
+  insert_return_type emplace(Args&&... args)
+  { // constructs the node in place from (key, data) or
+    // (std::piecewise_construct, key tuple, data tuple)
+    pointer node = _Create_node(std::forward<Args>(args)...);
+    if constexpr (Traits::unique_keys) {
+      pointer parent = nullptr;
+      bool left = false;
+      pointer exists = _Insert_pos(node->key_, parent, left);
+      if (exists != nullptr) {
+        _Destroy_node(node);
+        return std::make_pair(iterator(exists, &header_), false);
+      }
+      _Link(node, parent, left);
+      return std::make_pair(iterator(node, &header_), true);
+    }
+    else {
+      root_ = _Insert(root_, node);
+      return iterator(node, &header_);
+    }
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(const KeyType &key, Args&&... args)
+  { // constructs data in place only if key doesn't exist
+    return _Try_emplace(key, std::piecewise_construct,
+      std::forward_as_tuple(key),
+      std::forward_as_tuple(std::forward<Args>(args)...));
+  }
+
+  template <typename... Args>
+  std::pair<iterator, bool> try_emplace(KeyType &&key, Args&&... args)
+  { // same as above, moving the key into the node
+    return _Try_emplace(key, std::piecewise_construct,
+      std::forward_as_tuple(std::move(key)),
+      std::forward_as_tuple(std::forward<Args>(args)...));
   }
 
-  void insert_or_assign(const KeyType &key, const DataType &data)
+  template <typename D>
+  std::pair<iterator, bool> insert_or_assign(const KeyType &key, D &&data)
   { // inserts if key doesn't exists, otherwise assigns data to the key
-    pointer exists = _Search(root_, key);
-    if (exists == nullptr)
-      insert(key, data);
-    else {
-      exists->data_ = data;
+    return _Insert_or_assign(key, key, std::forward<D>(data));
+  }
+
+  template <typename D>
+  std::pair<iterator, bool> insert_or_assign(KeyType &&key, D &&data)
+  { // same as above, moving the key into the node
+    return _Insert_or_assign(key, std::move(key), std::forward<D>(data));
+  }
+
+  template <typename InputIt>
+  void assign_sorted(InputIt first, InputIt last)
+  { // replaces the contents with the pairs of [first, last), which
+    // must be sorted (strictly, if keys are unique), in O(n): the
+    // nodes are allocated in key order and linked into a perfectly
+    // balanced tree without comparisons or rotations
+    clear();
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
+    if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+      size_type n = static_cast<size_type>(std::distance(first, last));
+      auto next = [&]() {
+        pointer node = _Create_node(first->first, first->second);
+        ++first;
+        return node;
+      };
+      root_ = _Build_balanced(next, n, 0, _Red_depth(n));
+      size_ = n;
+      _Reset_ends();
     }
+    else
+    { // single pass range: count it first
+      std::vector<typename std::iterator_traits<InputIt>::value_type>
+        buffer(first, last);
+      assign_sorted(std::make_move_iterator(buffer.begin()),
+        std::make_move_iterator(buffer.end()));
+    }
+  }
+
+  template <typename InputIt>
+  void insert_batch(InputIt first, InputIt last)
+  { // inserts a batch of unsorted pairs: sorts the batch, then
+    // merges it into the tree, see _Merge_sorted_batch
+    std::vector<std::pair<KeyType, DataType>> batch(first, last);
+    std::stable_sort(batch.begin(), batch.end(), _Batch_less());
+    _Merge_sorted_batch(batch);
   }
 
-  // void insert(iterator & it, const KeyType &key)
-  //{ // unimplemented
-  // since insertion at arbitrary place in red black tree is not
-  // possible. Think of inserting 5 at position 1 in { 1, 2, 3, 4 }
-  // }
+  template <typename ExecutionPolicy, typename InputIt>
+  void insert_batch(ExecutionPolicy &&policy, InputIt first, InputIt last)
+  { // same as above, sorting with an execution policy from
+    // <execution> such as std::execution::par
+    std::vector<std::pair<KeyType, DataType>> batch(first, last);
+    std::stable_sort(std::forward<ExecutionPolicy>(policy),
+      batch.begin(), batch.end(), _Batch_less());
+    _Merge_sorted_batch(batch);
+  }
+
+  // hinted insertion: if key belongs right before or right after
+  // hint, the node is linked there without a descent from root_;
+  // otherwise it falls back to a normal insert. Feeding back the
+  // iterator of the previous insert makes sorted streams cheap.
+  iterator insert(iterator hint, const KeyType &key, const DataType &data)
+  {
+    return _Emplace_hint(hint._Ptr(), key, key, data);
+  }
+
+  iterator insert(iterator hint, std::pair<KeyType, DataType> &&p)
+  {
+    return _Emplace_hint(hint._Ptr(), p.first,
+      std::move(p.first), std::move(p.second));
+  }
+
+  template <typename... Args>
+  iterator emplace_hint(iterator hint, Args&&... args)
+  { // constructs the node in place, then places it next to hint
+    pointer node = _Create_node(std::forward<Args>(args)...);
+    pointer parent = nullptr, exists = nullptr;
+    bool left = false;
+    if (!_Hint_pos(hint._Ptr(), node->key_, parent, left, exists))
+      exists = _Insert_pos_for(node->key_, parent, left);
+    if (exists != nullptr) {
+      _Destroy_node(node);
+      return iterator(exists, &header_);
+    }
+    _Link(node, parent, left);
+    return iterator(node, &header_);
+  }
   
   void erase(const KeyType &key)
   {
-    pointer toDelete = _Search(root_, key);
-    
-    if (toDelete == nullptr) return;
+    _Erase_key(key);
+  }
 
-    toDelete = _Delete(root_, toDelete);
-    delete toDelete;
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  void erase(const K &key)
+  { // erases an element whose key is equivalent to key,
+    // without building a KeyType
+    _Erase_key(key);
   }
 
   void erase(iterator &_start, iterator &_end)
@@ -500,26 +1347,77 @@ public:
     _Erase_range(_start, _end);
   }
 
+  template <typename K>
+  size_type erase_range(const K &lo, const K &hi)
+  { // erases the elements with key in [lo, hi) and returns how many:
+    // two splits cut the range out in O(log n), a join closes the
+    // gap, and the detached nodes are freed in one linear walk
+    if (IsNil(root_) || !comp_(lo, hi))
+      return 0;
+    _Subtree left, rest, range, right;
+    _Split(root_, _Black_height(root_), lo, left.root, left.height,
+      rest.root, rest.height);
+    _Split(rest.root, rest.height, hi, range.root, range.height,
+      right.root, right.height);
+    root_ = _Join2(left, right).root;
+    if (!IsNil(root_))
+      _Set_color(root_, BLACK);
+    _Reset_ends();
+    size_type erased = 0;
+    if (!IsNil(range.root))
+      erased = _Destroy_subtree(range.root, true);
+    size_ -= erased;
+    return erased;
+  }
+
   const_iterator cbegin() const 
   { // returns const_iterator to the minimum key
-    return const_iterator(_Min(root_));
+    return const_iterator(header_.leftmost_, &header_);
   }
 
   const_iterator cend() const
   { // returns const_iterator to the nil[T]
-    return const_iterator();
+    return const_iterator(nullptr, &header_);
   }
 
   iterator begin()
   { // returns iterator to the minimum element
-    return iterator(_Min(root_));
+    return iterator(header_.leftmost_, &header_);
   }
 
   iterator end()
   { // returns iterator to the nil[T]
-    return iterator();
+    return iterator(nullptr, &header_);
+  }
+
+  reverse_iterator rbegin()
+  { return reverse_iterator(end()); }
+
+  reverse_iterator rend()
+  { return reverse_iterator(begin()); }
+
+  const_reverse_iterator crbegin() const
+  { return const_reverse_iterator(cend()); }
+
+  const_reverse_iterator crend() const
+  { return const_reverse_iterator(cbegin()); }
+
+  NodeType &front()
+  { // the minimum element, the tree must not be empty
+    return *header_.leftmost_;
+  }
+
+  const NodeType &front() const
+  { return *header_.leftmost_; }
+
+  NodeType &back()
+  { // the maximum element, the tree must not be empty
+    return *header_.rightmost_;
   }
 
+  const NodeType &back() const
+  { return *header_.rightmost_; }
+
   void erase(const iterator &it)
   {
     this->_Safe_remove(it);
@@ -533,13 +1431,264 @@ public:
   const_iterator search(const KeyType &key) const
   {
     pointer searched = _Search(root_, key);
-    return const_iterator(searched);
+    return const_iterator(searched, &header_);
   }
 
   iterator search(const KeyType &key)
   {
     pointer searched = _Search(root_, key);
-    return iterator(searched);
+    return iterator(searched, &header_);
+  }
+
+  // heterogeneous lookup, enabled when Compare::is_transparent
+  // exists (e.g. std::less<>): searches by any key-like type,
+  // such as std::string_view for std::string keys
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  const_iterator search(const K &key) const
+  {
+    pointer searched = _Search(root_, key);
+    return const_iterator(searched, &header_);
+  }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  iterator search(const K &key)
+  {
+    pointer searched = _Search(root_, key);
+    return iterator(searched, &header_);
+  }
+
+  // batched lookup: searches every key of [first, last) and writes
+  // the results, an iterator or end() per key, to out in order.
+  // The descents are interleaved in groups, see _Search_batch, so
+  // the cache misses of a group overlap instead of queueing up
+  template <typename ForwardIt, typename OutputIt>
+  OutputIt search_batch(ForwardIt first, ForwardIt last, OutputIt out) const
+  {
+    _Search_batch(first, last, [&](pointer found) {
+      *out++ = const_iterator(found, &header_);
+    });
+    return out;
+  }
+
+  template <typename ForwardIt, typename OutputIt>
+  OutputIt search_batch(ForwardIt first, ForwardIt last, OutputIt out)
+  {
+    _Search_batch(first, last, [&](pointer found) {
+      *out++ = iterator(found, &header_);
+    });
+    return out;
+  }
+
+  template <typename Keys, typename OutputIt>
+  OutputIt search_batch(const Keys &keys, OutputIt out) const
+  { return search_batch(std::begin(keys), std::end(keys), out); }
+
+  template <typename Keys, typename OutputIt>
+  OutputIt search_batch(const Keys &keys, OutputIt out)
+  { return search_batch(std::begin(keys), std::end(keys), out); }
+
+  FrozenRBTree<KeyType, DataType, Compare> freeze() const
+  { // immutable copy laid out for lookups, built in O(n); needs
+    // #include "rbtree_frozen.h"
+    return FrozenRBTree<KeyType, DataType, Compare>(*this);
+  }
+
+  // ordered queries; the K overloads take key-like types when
+  // Compare::is_transparent exists
+  iterator lower_bound(const KeyType &key)
+  { // first element whose key is not less than key
+    return iterator(_Lower_bound(key), &header_);
+  }
+
+  const_iterator lower_bound(const KeyType &key) const
+  { return const_iterator(_Lower_bound(key), &header_); }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  iterator lower_bound(const K &key)
+  { return iterator(_Lower_bound(key), &header_); }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  const_iterator lower_bound(const K &key) const
+  { return const_iterator(_Lower_bound(key), &header_); }
+
+  iterator upper_bound(const KeyType &key)
+  { // first element whose key is greater than key
+    return iterator(_Upper_bound(key), &header_);
+  }
+
+  const_iterator upper_bound(const KeyType &key) const
+  { return const_iterator(_Upper_bound(key), &header_); }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  iterator upper_bound(const K &key)
+  { return iterator(_Upper_bound(key), &header_); }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  const_iterator upper_bound(const K &key) const
+  { return const_iterator(_Upper_bound(key), &header_); }
+
+  std::pair<iterator, iterator> equal_range(const KeyType &key)
+  { // range of elements whose key is equivalent to key
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+  std::pair<const_iterator, const_iterator>
+    equal_range(const KeyType &key) const
+  { return std::make_pair(lower_bound(key), upper_bound(key)); }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  std::pair<iterator, iterator> equal_range(const K &key)
+  { return std::make_pair(lower_bound(key), upper_bound(key)); }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const
+  { return std::make_pair(lower_bound(key), upper_bound(key)); }
+
+  template <typename K, typename Fn>
+  void for_each_in_range(const K &lo, const K &hi, Fn &&fn)
+  { // calls fn(key, data) for every element with key in [lo, hi),
+    // in order: one descent to lo, then successor steps
+    for (pointer node = _Lower_bound(lo);
+      !IsNil(node) && comp_(node->key_, hi); node = _Next(node))
+      fn(static_cast<const KeyType &>(node->key_), node->data_);
+  }
+
+  template <typename K, typename Fn>
+  void for_each_in_range(const K &lo, const K &hi, Fn &&fn) const
+  {
+    for (pointer node = _Lower_bound(lo);
+      !IsNil(node) && comp_(node->key_, hi); node = _Next(node))
+      fn(static_cast<const KeyType &>(node->key_),
+        static_cast<const DataType &>(node->data_));
+  }
+
+  template <typename K>
+  RBTree split(const K &key)
+  { // keeps the elements with key less than key and moves the
+    // others into the returned tree, in O(log n) by cutting along
+    // the search path and joining the pieces back; counting the
+    // halves may add O(min(k, n - k)), see _Resize_after_split
+    RBTree right(comp_, allocator_type(alloc_));
+    int leftHeight = 0, rightHeight = 0;
+    _Split(root_, _Black_height(root_), key, root_, leftHeight,
+      right.root_, rightHeight);
+    _Resize_after_split(right);
+    return right;
+  }
+
+  static RBTree join(RBTree &&left, std::pair<KeyType, DataType> pivot,
+    RBTree &&right)
+  { // left, pivot and right in that order, all keys of left not
+    // greater than pivot's and all keys of right not less; O(log n)
+    // by linking the lower tree where the black heights match
+    RBTree tree(std::move(left));
+    RBTree rest(_Same_alloc(std::move(right), tree.alloc_));
+    pointer node = tree._Create_node(std::move(pivot.first),
+      std::move(pivot.second));
+    int height = 0;
+    tree.root_ = tree._Join(tree.root_, _Black_height(tree.root_), node,
+      rest.root_, _Black_height(rest.root_), height);
+    rest.root_ = nullptr;
+    tree._Resize_after_join(rest, 1);
+    return tree;
+  }
+
+  static RBTree concat(RBTree &&left, RBTree &&right)
+  { // left followed by right, keys of left not greater than those
+    // of right; the minimum of right becomes the pivot of a join
+    RBTree tree(std::move(left));
+    RBTree rest(_Same_alloc(std::move(right), tree.alloc_));
+    if (rest.empty())
+      return tree;
+    if (tree.empty())
+      return rest;
+    pointer node = rest._Delete(rest.root_, rest._Min(rest.root_));
+    int height = 0;
+    tree.root_ = tree._Join(tree.root_, _Black_height(tree.root_), node,
+      rest.root_, _Black_height(rest.root_), height);
+    rest.root_ = nullptr;
+    tree._Resize_after_join(rest, 1);
+    return tree;
+  }
+
+  // set algebra over unique keys, see tree_union
+  template <typename K, typename D, typename C, typename A, typename T>
+  friend RBTree<K, D, C, A, T> tree_union(RBTree<K, D, C, A, T> lhs,
+    RBTree<K, D, C, A, T> rhs);
+  template <typename K, typename D, typename C, typename A, typename T>
+  friend RBTree<K, D, C, A, T> tree_intersection(RBTree<K, D, C, A, T> lhs,
+    RBTree<K, D, C, A, T> rhs);
+  template <typename K, typename D, typename C, typename A, typename T>
+  friend RBTree<K, D, C, A, T> tree_difference(RBTree<K, D, C, A, T> lhs,
+    RBTree<K, D, C, A, T> rhs);
+
+  // order statistics, need RBTreeTraits::order_statistics
+  iterator select(size_type k)
+  { // k-th smallest element (from 0), end() if k >= size()
+    static_assert(Traits::order_statistics,
+      "select() needs RBTreeTraits::order_statistics");
+    return iterator(_Select(root_, k), &header_);
+  }
+
+  const_iterator select(size_type k) const
+  {
+    static_assert(Traits::order_statistics,
+      "select() needs RBTreeTraits::order_statistics");
+    return const_iterator(_Select(root_, k), &header_);
+  }
+
+  template <typename K>
+  size_type rank(const K &key) const
+  { // number of elements whose key is less than key
+    static_assert(Traits::order_statistics,
+      "rank() needs RBTreeTraits::order_statistics");
+    return static_cast<size_type>(_Rank(key));
+  }
+
+  template <typename K>
+  size_type count_in_range(const K &lo, const K &hi) const
+  { // number of elements with key in [lo, hi)
+    static_assert(Traits::order_statistics,
+      "count_in_range() needs RBTreeTraits::order_statistics");
+    if (!comp_(lo, hi))
+      return 0;
+    return static_cast<size_type>(_Rank(hi) - _Rank(lo));
+  }
+
+  // interval queries, need RBIntervalTraits
+  template <typename T, typename Fn>
+  void overlapping(const T &a, const T &b, Fn fn) const
+  { // calls fn(interval, data) for every interval meeting [a, b],
+    // in order of low endpoint
+    static_assert(_Is_interval_aggregate<typename Traits::aggregate>::value,
+      "overlapping() needs RBIntervalTraits");
+    _Overlapping(root_, a, b, fn);
+  }
+
+  template <typename T>
+  bool any_overlap(const T &a, const T &b) const
+  { // true if some interval meets [a, b]: a single descent that
+    // goes left whenever the left subtree reaches up to a
+    static_assert(_Is_interval_aggregate<typename Traits::aggregate>::value,
+      "any_overlap() needs RBIntervalTraits");
+    pointer node = root_;
+    while (!IsNil(node)) {
+      if (!(b < node->key_.first) && !(node->key_.second < a))
+        return true;
+      if (!IsNil(Left(node)) && !(Left(node)->agg_ < a))
+        node = node->left_;
+      else
+        node = node->right_;
+    }
+    return false;
   }
 
   DataType operator[](const KeyType &_key) const
@@ -551,18 +1700,83 @@ public:
       return searched->data_;
   }
 
-  DataType& operator[](const KeyType &_key)
-  { // returns data field corresponding to the key
+  data_reference operator[](const KeyType &_key)
+  { // returns data field corresponding to the key,
+    // inserting a value-initialized one if it doesn't exist
+    return _Data_ref(_Try_emplace(_key, std::piecewise_construct,
+      std::forward_as_tuple(_key), std::tuple<>()).first._Ptr());
+  }
+
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent>
+  DataType operator[](const K &_key) const
+  { // returns data field corresponding to the key-like _key
     pointer searched = _Search(root_, _key);
-    if (searched == nullptr) 
-    { // inserts the key into the tree
-      iterator inserted = insert(_key, DataType());
-      return (*inserted).data_;
-    }
+    if (searched == nullptr)
+      return DataType();
     else
       return searched->data_;
   }
 
+  template <typename K, typename C = Compare,
+    typename = typename C::is_transparent,
+    typename = std::enable_if_t<std::is_constructible<KeyType, const K &>::value>>
+  data_reference operator[](const K &_key)
+  { // a KeyType is built from _key only if it must be inserted
+    return _Data_ref(_Try_emplace(_key, std::piecewise_construct,
+      std::forward_as_tuple(_key), std::tuple<>()).first._Ptr());
+  }
+
+  template <typename Fn>
+  void modify(const iterator &it, Fn fn)
+  { // calls fn(data) on the element at it and refreshes the
+    // aggregates above it; use it instead of writing through
+    // (*it).Data() when the traits have an aggregate
+    pointer node = const_cast<iterator &>(it)._Ptr();
+    fn(node->data_);
+    _Update_path(node);
+  }
+
+  template <typename K, typename P = typename Traits::aggregate>
+  typename P::value_type aggregate(const K &lo, const K &hi) const
+  { // combines the elements with key in [lo, hi) in key order:
+    // the left spine of the split node gives the part >= lo and
+    // the right spine the part < hi, one subtree at a time
+    pointer split = root_;
+    while (!IsNil(split)) {
+      if (comp_(split->key_, lo))
+        split = split->right_;
+      else if (!comp_(split->key_, hi))
+        split = split->left_;
+      else break;
+    }
+    if (IsNil(split))
+      return P::identity();
+
+    typename P::value_type suffix = P::identity();
+    for (pointer node = split->left_; !IsNil(node); ) {
+      if (comp_(node->key_, lo))
+        node = node->right_;
+      else {
+        suffix = P::combine(P::combine(P::lift(node->key_, node->data_),
+          _Agg(node->right_)), suffix);
+        node = node->left_;
+      }
+    }
+
+    typename P::value_type prefix = P::identity();
+    for (pointer node = split->right_; !IsNil(node); ) {
+      if (comp_(node->key_, hi)) {
+        prefix = P::combine(P::combine(prefix, _Agg(node->left_)),
+          P::lift(node->key_, node->data_));
+        node = node->right_;
+      }
+      else node = node->left_;
+    }
+    return P::combine(P::combine(suffix,
+      P::lift(split->key_, split->data_)), prefix);
+  }
+
 
 private:
 
@@ -572,36 +1786,264 @@ private:
     root_ = _Insert(root_, node);
   }
 
-  void _Clone(const_iterator &_start, const_iterator &_end)
-  { // _Clones from tree into root tree
-    for (const_iterator it = _start; it != _end; ++it)
-    { // inserts every node pointed by iterator
-      pointer node = _Create_node((*it).key_, (*it).data_);
-      root_ = _Insert(root_, node);
+  struct _Batch_less {
+    Compare comp_;
+    bool operator()(const std::pair<KeyType, DataType> &lhs,
+      const std::pair<KeyType, DataType> &rhs) const
+    { return comp_(lhs.first, rhs.first); }
+  };
+
+  void _Merge_sorted_batch(std::vector<std::pair<KeyType, DataType>> &batch)
+  { // a batch that is large next to the tree is merged with the
+    // existing nodes and everything is relinked balanced in
+    // O(n + k); a small one is inserted in order by finger search
+    // from the previous element, see _Finger_root, which costs
+    // O(k log(n / k)) over the batch
+    size_type k = static_cast<size_type>(batch.size());
+    if (k == 0)
+      return;
+    size_type logN = _Red_depth(size()) + 1;
+    if (static_cast<unsigned long long>(k) * logN < size_) {
+      pointer finger = nullptr;
+      for (auto &p : batch) {
+        pointer parent = nullptr;
+        bool left = false;
+        pointer exists = _Insert_pos_for(p.first, parent, left,
+          _Finger_root(finger, p.first));
+        if (exists != nullptr) {
+          finger = exists;
+          continue;
+        }
+        finger = _Create_node(std::move(p.first), std::move(p.second));
+        _Link(finger, parent, left);
+      }
+      return;
+    }
+
+    // allocate the new nodes up front, so nothing below can throw
+    // once the tree starts being taken apart
+    std::vector<pointer> fresh;
+    fresh.reserve(k);
+    try {
+      for (size_type i = 0; i < k; i++) {
+        // the batch keys before i have been moved into nodes, so
+        // compare with the last key kept
+        if (Traits::unique_keys && !fresh.empty() &&
+          !comp_(fresh.back()->key_, batch[i].first))
+          continue; // equal to the previous batch key
+        fresh.push_back(_Create_node(std::move(batch[i].first),
+          std::move(batch[i].second)));
+      }
+    }
+    catch (...) {
+      for (pointer node : fresh)
+        _Destroy_node(node);
+      throw;
+    }
+
+    std::vector<pointer> merged;
+    try {
+      merged.reserve(size_ + fresh.size());
+    }
+    catch (...) {
+      for (pointer node : fresh)
+        _Destroy_node(node);
+      throw;
+    }
+    pointer old = _Min(root_);
+    auto added = fresh.begin();
+    while (!IsNil(old) || added != fresh.end()) {
+      if (added == fresh.end() ||
+        (!IsNil(old) && !comp_((*added)->key_, old->key_))) {
+        if (Traits::unique_keys && added != fresh.end() &&
+          !comp_(old->key_, (*added)->key_)) {
+          _Destroy_node(*added); // key already in the tree
+          ++added;
+        }
+        merged.push_back(old);
+        old = _Next(old);
+      }
+      else
+        merged.push_back(*added++);
+    }
+
+    size_type n = static_cast<size_type>(merged.size());
+    auto it = merged.begin();
+    auto next = [&]() { return *it++; };
+    root_ = _Build_balanced(next, n, 0, _Red_depth(n));
+    size_ = n;
+    _Reset_ends();
+  }
+
+  static size_type _Red_depth(size_type n)
+  { // depth of the incomplete bottom level of a balanced tree of
+    // n nodes: floor(log2(n + 1)); empty if n + 1 is a power of two
+    size_type depth = 0;
+    for (unsigned long long full = 1; full * 2 <= n + 1ull; full *= 2)
+      depth++;
+    return depth;
+  }
+
+  template <typename NodeSource>
+  pointer _Build_balanced(NodeSource &next, size_type n,
+    size_type depth, size_type redDepth)
+  { // links the next n nodes of next() in-order into a balanced
+    // subtree: both halves differ by at most one node, so every
+    // nil[T] sits on one of the two bottom levels, and coloring
+    // only the incomplete bottom level red keeps black heights equal
+    if (n == 0)
+      return nullptr;
+    pointer left = _Build_balanced(next, n / 2, depth + 1, redDepth);
+    pointer node = nullptr;
+    try {
+      node = next();
+    }
+    catch (...) {
+      if (!IsNil(left))
+        _Destroy_subtree(left, true);
+      throw;
+    }
+    node->left_ = left;
+    node->right_ = nullptr;
+    _Set_parent(node, nullptr);
+    _Set_color(node, depth == redDepth ? RED : BLACK);
+    if (!IsNil(left))
+      _Set_parent(left, node);
+    try {
+      node->right_ = _Build_balanced(next, n - n / 2 - 1, depth + 1, redDepth);
+    }
+    catch (...) {
+      _Destroy_subtree(node, true);
+      throw;
+    }
+    if (!IsNil(Right(node)))
+      _Set_parent(node->right_, node);
+    _Update(node);
+    return node;
+  }
+
+  void _Clone(const RBTree &rhs)
+  { // copies shape and colors of rhs, no comparisons or fixups
+    if (!IsNil(rhs.root_))
+      root_ = _Copy_subtree(rhs.root_, nullptr);
+    size_ = rhs.size();
+    _Reset_ends();
+  }
+
+  template <bool Move = false>
+  pointer _Copy_subtree(pointer src, pointer parent)
+  { // copies (or moves) src and its subtrees in pre-order under parent
+    pointer node = nullptr;
+    if constexpr (Move)
+      node = _Create_node(std::move(src->key_), std::move(src->data_));
+    else
+      node = _Create_node(src->key_, src->data_);
+    _Set_color(node, _Color(src));
+    _Set_parent(node, parent);
+    try {
+      if (!IsNil(Left(src)))
+        node->left_ = _Copy_subtree<Move>(Left(src), node);
+      if (!IsNil(Right(src)))
+        node->right_ = _Copy_subtree<Move>(Right(src), node);
+    }
+    catch (...)
+    { // free whatever has been copied below node so far
+      _Destroy_subtree(node, true);
+      throw;
     }
+    _Update(node);
+    return node;
   }
 
   void _Clear(pointer &root)
-  { // clears in post-order
-    if (!empty())
-      _Erase_range(begin(), end());
+  { // clears in post-order, without any rebalancing
+    if (IsNil(root))
+      return;
+    if (_Pool_exclusive()) {
+      // nobody else draws from the pool: run the destructors only
+      // if there are any, then hand every chunk back at once
+      if (!std::is_trivially_destructible<NodeType>::value)
+        _Destroy_subtree(root, false);
+      _Pool_release(alloc_);
+    }
+    else
+      _Destroy_subtree(root, true);
+    if (root == root_) {
+      size_ = 0;
+      header_ = _RBTree_header<NodeType>();
+    }
+    root = nullptr;
+  }
+
+  size_type _Destroy_subtree(pointer node, bool deallocate)
+  { // frees every node below and including node in post-order,
+    // returns how many
+    size_type freed = 0;
+    pointer stop = Parent(node);
+    while (node != stop) {
+      if (!IsNil(Left(node)))
+        node = Left(node);
+      else if (!IsNil(Right(node)))
+        node = Right(node);
+      else
+      { // leaf: unlink it from its parent and free it
+        pointer parent = Parent(node);
+        if (parent != stop) {
+          if (node == Left(parent))
+            parent->left_ = nullptr;
+          else
+            parent->right_ = nullptr;
+        }
+        if (deallocate)
+          _Destroy_node(node);
+        else
+          node_traits::destroy(alloc_, node);
+        freed++;
+        node = parent;
+      }
+    }
+    return freed;
   }
 
+  __ bool _Pool_exclusive() const
+  { // true if the nodes come from a pool no one else shares
+    return _Pool_exclusive(alloc_);
+  }
+
+  template <typename Alloc>
+  static bool _Pool_exclusive(const Alloc &)
+  { return false; }
+
+  static bool _Pool_exclusive(const RBPoolAllocator<NodeType> &alloc)
+  { return alloc._Exclusive(); }
+
+  template <typename Alloc>
+  static void _Pool_release(Alloc &)
+  { }
+
+  static void _Pool_release(RBPoolAllocator<NodeType> &alloc)
+  { alloc._Release_all(); }
+
   void _Safe_remove(pointer &node)
   { // safely removes the node, preserving RB properties
     pointer target = _Delete(root_, node);
-    delete target;
+    _Destroy_node(target);
   }
 
   void _Safe_remove(iterator node)
   { // safely removes the element preserving RB properties
     pointer target = (node)._Ptr();
     target = _Delete(root_, target);
-    delete target;
+    _Destroy_node(target);
   }
 
   void _Erase_range(const iterator &_start, const iterator &_end)
   { // erases range of elements from _start to _end
+    if (_start == begin() && _end == end())
+    { // whole tree, no need to rebalance anything
+      _Clear(root_);
+      return;
+    }
     iterator itr = _start, next = _start, prev = _start;
     if (itr != end())
       do {
@@ -611,17 +2053,814 @@ private:
       } while (next != _end);
   }
 
-  pointer _Search(pointer &root, const KeyType &key) const
-  { // returns pointer to the node if found with key_ = key
-    pointer ptr = root;
-    while (!IsNil(ptr)) {
-      if (key == ptr->key_)
+  template <typename K, typename... Args>
+  insert_return_type _Emplace_key(const K &key, Args&&... args)
+  { // inserts a node built from args whose key is key; with unique
+    // keys, nothing is allocated if key already exists
+    if constexpr (Traits::unique_keys)
+      return _Try_emplace(key, std::forward<Args>(args)...);
+    else {
+      pointer node = _Create_node(std::forward<Args>(args)...);
+      root_ = _Insert(root_, node);
+      return iterator(node, &header_);
+    }
+  }
+
+  data_reference _Data_ref(pointer node)
+  { // what operator[] hands out for node
+    if constexpr (_Has_aggregate)
+      return _Aggregate_data_ref(this, node);
+    else
+      return node->data_;
+  }
+
+  template <typename K, typename... Args>
+  std::pair<iterator, bool> _Try_emplace(const K &key, Args&&... args)
+  { // single descent: returns the node equivalent to key, or
+    // links a node built from args where the search stopped
+    pointer parent = nullptr;
+    bool left = false;
+    pointer exists = _Insert_pos(key, parent, left);
+    if (exists != nullptr)
+      return std::make_pair(iterator(exists, &header_), false);
+    pointer node = _Create_node(std::forward<Args>(args)...);
+    _Link(node, parent, left);
+    return std::make_pair(iterator(node, &header_), true);
+  }
+
+  template <typename K, typename D>
+  std::pair<iterator, bool> _Insert_or_assign(const KeyType &key,
+    K &&nodeKey, D &&data)
+  { // single descent: assigns data to the node equivalent to key,
+    // or links a new node where the search stopped
+    pointer parent = nullptr;
+    bool left = false;
+    pointer exists = _Insert_pos(key, parent, left);
+    if (exists != nullptr) {
+      exists->data_ = std::forward<D>(data);
+      _Update_path(exists);
+      return std::make_pair(iterator(exists, &header_), false);
+    }
+    pointer node = _Create_node(std::forward<K>(nodeKey), std::forward<D>(data));
+    _Link(node, parent, left);
+    return std::make_pair(iterator(node, &header_), true);
+  }
+
+  template <typename K, typename... Args>
+  iterator _Emplace_hint(pointer hint, const K &key, Args&&... args)
+  { // places a node built from args next to hint, or by a descent
+    // from root_ if the hint is wrong
+    pointer parent = nullptr, exists = nullptr;
+    bool left = false;
+    if (!_Hint_pos(hint, key, parent, left, exists))
+      exists = _Insert_pos_for(key, parent, left);
+    if (exists != nullptr)
+      return iterator(exists, &header_);
+    pointer node = _Create_node(std::forward<Args>(args)...);
+    _Link(node, parent, left);
+    return iterator(node, &header_);
+  }
+
+  template <typename K>
+  pointer _Insert_pos_for(const K &key, pointer &parent, bool &left,
+    pointer from = nullptr) const
+  { // link position of key found by a descent; an equivalent node
+    // is returned only when keys are unique
+    if constexpr (Traits::unique_keys)
+      return _Insert_pos(key, parent, left, from);
+    else {
+      pointer itr = IsNil(from) ? root_ : from;
+      parent = nullptr;
+      left = false;
+      while (!IsNil(itr)) {
+        parent = itr;
+        left = comp_(key, itr->key_);
+        itr = left ? itr->left_ : itr->right_;
+      }
+      return nullptr;
+    }
+  }
+
+  template <typename K>
+  bool _Hint_pos(pointer hint, const K &key,
+    pointer &parent, bool &left, pointer &exists) const
+  { // finds the link position of key among hint and its neighbours;
+    // false if key doesn't belong there. A nil hint means end().
+    pointer pred = nullptr, succ = nullptr;
+    exists = nullptr;
+    if constexpr (Traits::unique_keys) {
+      if (IsNil(hint)) {
+        pred = header_.rightmost_;
+        if (!IsNil(pred) && !comp_(pred->key_, key))
+          return false;
+      }
+      else if (comp_(key, hint->key_)) {
+        succ = hint;
+        pred = _Prev(hint);
+        if (!IsNil(pred) && !comp_(pred->key_, key))
+          return false;
+      }
+      else if (comp_(hint->key_, key)) {
+        pred = hint;
+        succ = _Next(hint);
+        if (!IsNil(succ) && !comp_(key, succ->key_))
+          return false;
+      }
+      else
+      { // key is already in the tree
+        exists = hint;
+        return true;
+      }
+    }
+    else {
+      // equal keys may go on either side of hint
+      if (IsNil(hint) || !comp_(hint->key_, key)) {
+        succ = hint;
+        pred = IsNil(hint) ? header_.rightmost_ : _Prev(hint);
+        if (!IsNil(pred) && comp_(key, pred->key_))
+          return false;
+      }
+      else {
+        pred = hint;
+        succ = _Next(hint);
+        if (!IsNil(succ) && comp_(succ->key_, key))
+          return false;
+      }
+    }
+
+    // pred and succ are adjacent, so either pred has no right
+    // child or succ has no left child
+    if (!IsNil(pred) && IsNil(Right(pred))) {
+      parent = pred;
+      left = false;
+    }
+    else {
+      parent = succ;
+      left = true;
+    }
+    return true;
+  }
+
+  template <typename K>
+  pointer _Insert_pos(const K &key, pointer &parent, bool &left,
+    pointer from = nullptr) const
+  { // returns the node equivalent to key if there is one, otherwise
+    // nullptr with the parent and side a new node would be linked at.
+    // The descent starts at from if given, a subtree that holds both
+    // the position of key and any node equivalent to it
+    pointer itr = IsNil(from) ? root_ : from;
+    parent = nullptr;
+    left = false;
+    if constexpr (_Three_way_comparable<Compare, KeyType, K>::value) {
+      while (!IsNil(itr)) {
+        int order = key.compare(itr->key_);
+        if (order == 0)
+          return itr;
+        parent = itr;
+        left = order < 0;
+        itr = left ? itr->left_ : itr->right_;
+      }
+      return nullptr;
+    }
+    else {
+      // pred is the last node we went right from, i.e. the greatest
+      // key not above key: it is the only candidate for equivalence
+      pointer pred = nullptr;
+      while (!IsNil(itr)) {
+        parent = itr;
+        left = comp_(key, itr->key_);
+        if (left)
+          itr = itr->left_;
+        else {
+          pred = itr;
+          itr = itr->right_;
+        }
+      }
+      if (!IsNil(pred) && !comp_(pred->key_, key))
+        return pred;
+      return nullptr;
+    }
+  }
+
+  template <typename K>
+  pointer _Finger_root(pointer finger, const K &key) const
+  { // lowest subtree above finger that holds the position of key,
+    // for key not less than the key of finger: a subtree that is a
+    // left child ends below the key of its parent, so the climb
+    // stops at the first one whose parent is above key. With d
+    // nodes between finger and key, the climb and the descent
+    // from there are O(log d). A nil finger gives root_
+    if (IsNil(finger))
+      return root_;
+    pointer node = finger;
+    for (pointer parent = Parent(node); !IsNil(parent);
+      node = parent, parent = Parent(node))
+      if (node == Left(parent) && comp_(key, parent->key_))
+        break;
+    return node;
+  }
+
+  void _Link(pointer node, pointer parent, bool left)
+  { // links node as the left or right child of parent and rebalances
+    _Set_parent(node, parent);
+    if (IsNil(parent))
+      root_ = header_.leftmost_ = header_.rightmost_ = node;
+    else if (left) {
+      parent->left_ = node;
+      if (parent == header_.leftmost_)
+        header_.leftmost_ = node;
+    }
+    else {
+      parent->right_ = node;
+      if (parent == header_.rightmost_)
+        header_.rightmost_ = node;
+    }
+    _Update(node);
+    _Update_path(parent);
+    _FixInsert(root_, node);
+    size_++;
+  }
+
+  template <typename K>
+  void _Erase_key(const K &key)
+  { // erases one element whose key is equivalent to key
+    pointer toDelete = _Search(root_, key);
+    
+    if (toDelete == nullptr) return;
+
+    toDelete = _Delete(root_, toDelete);
+    _Destroy_node(toDelete);
+  }
+
+  template <typename T, typename Fn>
+  void _Overlapping(pointer node, const T &a, const T &b, Fn &fn) const
+  { // a subtree is skipped when nothing in it reaches up to a, the
+    // right one also when node already starts after b
+    while (!IsNil(node) && !(node->agg_ < a)) {
+      _Overlapping(node->left_, a, b, fn);
+      if (b < node->key_.first)
+        return;
+      if (!(node->key_.second < a))
+        fn(static_cast<const KeyType &>(node->key_), node->data_);
+      node = node->right_;
+    }
+  }
+
+  static int _Black_height(pointer node)
+  { // black nodes on any path from node down to nil[T]
+    int height = 0;
+    for (; node != nullptr; node = node->left_)
+      if (node->parent_._Color() == BLACK)
+        height++;
+    return height;
+  }
+
+  pointer _Join(pointer left, int leftHeight, pointer node, pointer right,
+    int rightHeight, int &height)
+  { // links the standalone trees left and right under node and
+    // returns the new root, with its black height in height. The
+    // lower tree hangs off the spine of the higher one at the first
+    // black node of the same height, node joins them as a red node
+    // and the usual insertion fixup settles the colors
+    if (!IsNil(left) && _Color(left) == RED) {
+      _Set_color(left, BLACK);
+      leftHeight++;
+    }
+    if (!IsNil(right) && _Color(right) == RED) {
+      _Set_color(right, BLACK);
+      rightHeight++;
+    }
+
+    if (leftHeight == rightHeight) {
+      node->left_ = left;
+      node->right_ = right;
+      _Set_parent(node, nullptr);
+      _Set_color(node, BLACK);
+      if (!IsNil(left))
+        _Set_parent(left, node);
+      if (!IsNil(right))
+        _Set_parent(right, node);
+      _Update(node);
+      height = leftHeight + 1;
+      return node;
+    }
+
+    bool tall = leftHeight > rightHeight;
+    pointer root = tall ? left : right;
+    pointer parent = nullptr, cut = root;
+    int level = tall ? leftHeight : rightHeight;
+    int target = tall ? rightHeight : leftHeight;
+    while (!IsNil(cut) && !(_Color(cut) == BLACK && level == target)) {
+      if (_Color(cut) == BLACK)
+        level--;
+      parent = cut;
+      cut = tall ? cut->right_ : cut->left_;
+    }
+
+    node->left_ = tall ? cut : left;
+    node->right_ = tall ? right : cut;
+    if (!IsNil(node->left_))
+      _Set_parent(node->left_, node);
+    if (!IsNil(node->right_))
+      _Set_parent(node->right_, node);
+    _Set_parent(node, parent);
+    _Set_color(node, RED);
+    if (tall)
+      parent->right_ = node;
+    else
+      parent->left_ = node;
+    _Update(node);
+    _Update_path(parent);
+    height = (tall ? leftHeight : rightHeight) + _FixInsert(root, node);
+    return root;
+  }
+
+  template <typename K>
+  void _Split(pointer tree, int height, const K &key, pointer &left,
+    int &leftHeight, pointer &right, int &rightHeight,
+    pointer *equal = nullptr)
+  { // cuts the standalone tree into nodes less than key and the
+    // rest; each node on the search path is joined with the subtree
+    // on its far side to one of the halves, the heights telescope
+    // so the whole cut costs O(log n). With equal, a node whose key
+    // is equivalent to key is detached into *equal instead (keys
+    // must be unique). The search path is found first, so a throwing
+    // comparison leaves the tree as it was
+    _Split_step path[_Max_height];
+    int length = 0;
+    for (pointer node = tree; !IsNil(node); length++) {
+      if (comp_(node->key_, key)) {
+        path[length] = _Split_right;
+        node = node->right_;
+      }
+      else if (equal != nullptr && !comp_(key, node->key_)) {
+        path[length++] = _Split_equal;
         break;
-      else if (key < ptr->key_)
+      }
+      else {
+        path[length] = _Split_left;
+        node = node->left_;
+      }
+    }
+    _Cut(tree, height, path, left, leftHeight, right, rightHeight, equal);
+  }
+
+  // an RBTree of n nodes is at most 2 log2(n + 1) high
+  static constexpr int _Max_height =
+    2 * std::numeric_limits<std::size_t>::digits;
+
+  enum _Split_step : unsigned char { _Split_left, _Split_right, _Split_equal };
+
+  void _Cut(pointer tree, int height, const _Split_step *path,
+    pointer &left, int &leftHeight, pointer &right, int &rightHeight,
+    pointer *equal)
+  { // _Split along a search path found beforehand; compares nothing
+    if (IsNil(tree)) {
+      left = right = nullptr;
+      leftHeight = rightHeight = 0;
+      return;
+    }
+    pointer lower = tree->left_, upper = tree->right_;
+    int childHeight = height - (_Color(tree) == BLACK);
+    if (!IsNil(lower))
+      _Set_parent(lower, nullptr);
+    if (!IsNil(upper))
+      _Set_parent(upper, nullptr);
+    if (*path == _Split_right) {
+      pointer inner = nullptr;
+      int innerHeight = 0;
+      _Cut(upper, childHeight, path + 1, inner, innerHeight, right,
+        rightHeight, equal);
+      left = _Join(lower, childHeight, tree, inner, innerHeight, leftHeight);
+    }
+    else if (*path == _Split_equal) {
+      left = lower;
+      right = upper;
+      leftHeight = rightHeight = childHeight;
+      *equal = _Detach(tree);
+    }
+    else {
+      pointer inner = nullptr;
+      int innerHeight = 0;
+      _Cut(lower, childHeight, path + 1, left, leftHeight, inner,
+        innerHeight, equal);
+      right = _Join(inner, innerHeight, tree, upper, childHeight, rightHeight);
+    }
+  }
+
+  // a standalone subtree and its black height, see _Join
+  struct _Subtree {
+    pointer root;
+    int height;
+  };
+
+  enum _Set_op { _Set_union, _Set_intersection, _Set_difference };
+
+  // a subtree of black height h has at least 2^h - 1 nodes; below
+  // this height a task costs more than it saves
+  static constexpr int _Fork_height = 10;
+
+  static RBTree _Set_algebra(_Set_op op, RBTree &&lhs, RBTree &&rhs)
+  { // union, intersection or difference of the two trees, reusing
+    // their nodes; the nodes dropped on the way are collected and
+    // freed at the end, so the parallel part never frees. At most
+    // one thread per extra core runs at a time. If a comparison
+    // throws, both trees end up dropped and are freed
+    static_assert(Traits::unique_keys,
+      "set operations need RBTreeTraits::unique_keys");
+    RBTree tree(std::move(lhs));
+    RBTree rest(_Same_alloc(std::move(rhs), tree.alloc_));
+    _Subtree a{ tree.root_, _Black_height(tree.root_) };
+    _Subtree b{ rest.root_, _Black_height(rest.root_) };
+    tree.root_ = rest.root_ = nullptr;
+
+    unsigned cores = std::thread::hardware_concurrency();
+    std::atomic<int> forks(cores > 1 ? static_cast<int>(cores) - 1 : 0);
+    std::vector<pointer> dropped;
+    _Subtree result;
+    try {
+      result = tree._Set_operation(op, a, b, forks, dropped);
+    }
+    catch (...) {
+      for (pointer node : dropped)
+        tree._Destroy_subtree(node, true);
+      tree.size_ = rest.size_ = 0;
+      throw;
+    }
+
+    tree.root_ = result.root;
+    if (tree.root_ != nullptr)
+      tree._Set_color(tree.root_, BLACK);
+    tree._Reset_ends();
+    // every node of either tree is kept or dropped
+    tree.size_ += rest.size_;
+    rest.size_ = 0;
+    for (pointer node : dropped)
+      tree.size_ -= tree._Destroy_subtree(node, true);
+    return tree;
+  }
+
+  _Subtree _Set_operation(_Set_op op, _Subtree a, _Subtree b,
+    std::atomic<int> &forks, std::vector<pointer> &dropped)
+  { // the root of one tree splits the other, the two sides recurse
+    // independently (in parallel while forks last) and are joined
+    // back, giving O(m log(n / m + 1)) work for sizes m <= n. If it
+    // throws, every node of a and b has been added to dropped
+    if (IsNil(a.root) || IsNil(b.root)) {
+      if (op == _Set_union)
+        return IsNil(a.root) ? b : a;
+      if (op == _Set_intersection && !IsNil(a.root))
+        dropped.push_back(a.root);
+      if (!IsNil(b.root))
+        dropped.push_back(b.root);
+      return op == _Set_difference ? a : _Subtree{ nullptr, 0 };
+    }
+
+    // union and intersection split b by the root of a, difference
+    // splits a by the root of b
+    _Subtree &whole = op == _Set_difference ? b : a;
+    _Subtree &cut = op == _Set_difference ? a : b;
+    pointer pivot = whole.root, equal = nullptr;
+    _Subtree cutLeft, cutRight;
+    try {
+      _Split(cut.root, cut.height, pivot->key_, cutLeft.root, cutLeft.height,
+        cutRight.root, cutRight.height, &equal);
+    }
+    catch (...)
+    { // _Split throws before cutting anything
+      dropped.push_back(a.root);
+      dropped.push_back(b.root);
+      throw;
+    }
+    int childHeight = whole.height - (_Color(pivot) == BLACK);
+    _Subtree wholeLeft{ pivot->left_, childHeight };
+    _Subtree wholeRight{ pivot->right_, childHeight };
+    _Detach(pivot);
+
+    _Subtree leftA = op == _Set_difference ? cutLeft : wholeLeft;
+    _Subtree leftB = op == _Set_difference ? wholeLeft : cutLeft;
+    _Subtree rightA = op == _Set_difference ? cutRight : wholeRight;
+    _Subtree rightB = op == _Set_difference ? wholeRight : cutRight;
+
+    // the right side runs on a thread of its own if one is free
+    std::vector<pointer> rightDropped;
+    std::future<_Subtree> task;
+    if (std::max(a.height, b.height) >= _Fork_height && _Take_fork(forks)) {
+      try {
+        task = std::async(std::launch::async, [&]() {
+          return _Set_operation(op, rightA, rightB, forks, rightDropped); });
+      }
+      catch (...) { // no thread, run it here
+        forks.fetch_add(1);
+      }
+    }
+
+    // both sides run to the end even if one throws, then whatever
+    // they returned is dropped with pivot
+    std::exception_ptr error;
+    _Subtree left, right;
+    bool leftDone = false, rightDone = false;
+    try {
+      left = _Set_operation(op, leftA, leftB, forks, dropped);
+      leftDone = true;
+    }
+    catch (...) {
+      error = std::current_exception();
+    }
+    if (task.valid()) {
+      try {
+        right = task.get();
+        rightDone = true;
+      }
+      catch (...) {
+        if (!error)
+          error = std::current_exception();
+      }
+      forks.fetch_add(1);
+      dropped.insert(dropped.end(), rightDropped.begin(), rightDropped.end());
+    }
+    else if (!error) {
+      try {
+        right = _Set_operation(op, rightA, rightB, forks, dropped);
+        rightDone = true;
+      }
+      catch (...) {
+        error = std::current_exception();
+      }
+    }
+    else { // the right side never ran
+      if (!IsNil(rightA.root))
+        dropped.push_back(rightA.root);
+      if (!IsNil(rightB.root))
+        dropped.push_back(rightB.root);
+    }
+
+    if (equal != nullptr)
+      dropped.push_back(equal);
+    if (error) {
+      if (leftDone && !IsNil(left.root))
+        dropped.push_back(left.root);
+      if (rightDone && !IsNil(right.root))
+        dropped.push_back(right.root);
+      dropped.push_back(pivot);
+      std::rethrow_exception(error);
+    }
+
+    _Subtree joined;
+    bool keep = op == _Set_union || (op == _Set_intersection && equal);
+    if (keep)
+      joined.root = _Join(left.root, left.height, pivot, right.root,
+        right.height, joined.height);
+    else {
+      dropped.push_back(pivot);
+      joined = _Join2(left, right);
+    }
+    return joined;
+  }
+
+  static bool _Take_fork(std::atomic<int> &forks)
+  { // claims one of the threads left, if any
+    int left = forks.load(std::memory_order_relaxed);
+    while (left > 0 &&
+      !forks.compare_exchange_weak(left, left - 1, std::memory_order_relaxed))
+      ;
+    return left > 0;
+  }
+
+  _Subtree _Join2(_Subtree left, _Subtree right)
+  { // joins two standalone trees without a pivot: the maximum of
+    // left is cut off and becomes one
+    if (IsNil(left.root))
+      return right;
+    if (IsNil(right.root))
+      return left;
+    pointer last = nullptr;
+    _Subtree rest = _Split_last(left, last);
+    _Subtree joined;
+    joined.root = _Join(rest.root, rest.height, last, right.root,
+      right.height, joined.height);
+    return joined;
+  }
+
+  _Subtree _Split_last(_Subtree tree, pointer &last)
+  { // removes the maximum of the standalone tree into last, joining
+    // the left subtrees on the right spine back in O(log n)
+    pointer node = tree.root;
+    int childHeight = tree.height - (_Color(node) == BLACK);
+    _Subtree lower{ node->left_, childHeight };
+    _Subtree upper{ node->right_, childHeight };
+    _Detach(node);
+    if (IsNil(upper.root)) {
+      last = node;
+      return lower;
+    }
+    _Subtree rest = _Split_last(upper, last);
+    _Subtree joined;
+    joined.root = _Join(lower.root, lower.height, node, rest.root,
+      rest.height, joined.height);
+    return joined;
+  }
+
+  __ pointer _Detach(pointer node)
+  { // unlinks node from its children, which become standalone trees
+    if (!IsNil(Left(node)))
+      _Set_parent(node->left_, nullptr);
+    if (!IsNil(Right(node)))
+      _Set_parent(node->right_, nullptr);
+    node->left_ = node->right_ = nullptr;
+    _Set_parent(node, nullptr);
+    return node;
+  }
+
+  static RBTree _Same_alloc(RBTree &&tree, const node_allocator &alloc)
+  { // tree itself if its nodes come from alloc, otherwise its
+    // elements moved into nodes of alloc
+    if (tree.alloc_ == alloc)
+      return std::move(tree);
+    RBTree copy(tree.comp_, allocator_type(alloc));
+    if (tree.root_ != nullptr)
+      copy.root_ = copy._Copy_subtree<true>(tree.root_, nullptr);
+    copy.size_ = tree.size();
+    copy._Reset_ends();
+    tree.clear();
+    return copy;
+  }
+
+  void _Resize_after_split(RBTree &right)
+  { // sizes of this tree and right, the two halves of this tree:
+    // subtree counts give them in O(1), otherwise both halves are
+    // walked in lockstep until the smaller one ends, which costs
+    // O(log n + min(k, n - k)). The ends are looked up again
+    size_type total = size_;
+    _Reset_ends();
+    right._Reset_ends();
+    if constexpr (Traits::order_statistics)
+      size_ = static_cast<size_type>(_Count(root_));
+    else {
+      size_type count = 0;
+      pointer lower = header_.leftmost_, upper = right.header_.leftmost_;
+      while (!IsNil(lower) && !IsNil(upper)) {
+        lower = _Next(lower);
+        upper = _Next(upper);
+        count++;
+      }
+      size_ = IsNil(lower) ? count : total - count;
+    }
+    right.size_ = total - size_;
+  }
+
+  void _Resize_after_join(const RBTree &rest, size_type pivots)
+  { // sizes add up
+    _Reset_ends();
+    size_ += rest.size_ + pivots;
+  }
+
+  pointer _Select(pointer node, std::size_t k) const
+  { // k-th smallest node of the subtree, nullptr if out of range
+    while (!IsNil(node)) {
+      std::size_t left = _Count(Left(node));
+      if (k < left)
+        node = Left(node);
+      else if (k == left)
+        return node;
+      else {
+        k -= left + 1;
+        node = Right(node);
+      }
+    }
+    return nullptr;
+  }
+
+  template <typename K>
+  std::size_t _Rank(const K &key) const
+  { // number of nodes whose key is less than key
+    std::size_t rank = 0;
+    pointer ptr = root_;
+    while (!IsNil(ptr)) {
+      if (comp_(ptr->key_, key)) {
+        rank += _Count(Left(ptr)) + 1;
+        ptr = ptr->right_;
+      }
+      else ptr = ptr->left_;
+    }
+    return rank;
+  }
+
+  template <typename K>
+  pointer _Lower_bound(const K &key) const
+  { // first node whose key is not less than key
+    pointer ptr = root_, bound = nullptr;
+    while (!IsNil(ptr)) {
+      if (!comp_(ptr->key_, key)) {
+        bound = ptr;
         ptr = ptr->left_;
+      }
       else ptr = ptr->right_;
     }
-    return ptr;
+    return bound;
+  }
+
+  template <typename K>
+  pointer _Upper_bound(const K &key) const
+  { // first node whose key is greater than key
+    pointer ptr = root_, bound = nullptr;
+    while (!IsNil(ptr)) {
+      if (comp_(key, ptr->key_)) {
+        bound = ptr;
+        ptr = ptr->left_;
+      }
+      else ptr = ptr->right_;
+    }
+    return bound;
+  }
+
+  template <typename K>
+  pointer _Search(pointer root, const K &key) const
+  { // returns pointer to the node if found with key_ equivalent to key
+    pointer ptr = root;
+    if constexpr (_Three_way_comparable<Compare, KeyType, K>::value) {
+      // one three-way comparison per level, stops at the first match
+      while (!IsNil(ptr)) {
+        int order = key.compare(ptr->key_);
+        if (order == 0)
+          break;
+        ptr = order < 0 ? ptr->left_ : ptr->right_;
+      }
+      return ptr;
+    }
+    else {
+      // one Compare call per level: descend to the lower bound
+      // and test equivalence once at the bottom
+      pointer bound = nullptr;
+      while (!IsNil(ptr)) {
+        if (!comp_(ptr->key_, key)) {
+          bound = ptr;
+          ptr = ptr->left_;
+        }
+        else ptr = ptr->right_;
+      }
+      if (!IsNil(bound) && comp_(key, bound->key_))
+        bound = nullptr;
+      return bound;
+    }
+  }
+
+  // lookups in flight at once in search_batch: enough to cover the
+  // latency of a miss, few enough for the state to stay in registers
+  static constexpr int _Batch_lanes = 16;
+
+  template <typename ForwardIt, typename Fn>
+  void _Search_batch(ForwardIt first, ForwardIt last, Fn emit) const
+  { // group prefetching: the keys are taken _Batch_lanes at a time
+    // and their descents advance one level per round, each lane
+    // prefetching the child it reads in the next round. A round
+    // then waits for about one miss instead of one per lane. The
+    // comparisons are those of _Search
+    using K = std::decay_t<decltype(*first)>;
+    constexpr bool three_way = _Three_way_comparable<Compare, KeyType, K>::value;
+    const K *keys[_Batch_lanes];
+    pointer node[_Batch_lanes], bound[_Batch_lanes];
+    while (first != last) {
+      int lanes = 0;
+      for (; lanes < _Batch_lanes && first != last; ++first, lanes++) {
+        keys[lanes] = std::addressof(*first);
+        node[lanes] = root_;
+        bound[lanes] = nullptr;
+      }
+      for (bool running = true; running; ) {
+        running = false;
+        for (int i = 0; i < lanes; i++) {
+          pointer ptr = node[i];
+          if (IsNil(ptr))
+            continue;
+          if constexpr (three_way) {
+            int order = keys[i]->compare(ptr->key_);
+            if (order == 0) {
+              bound[i] = ptr;
+              node[i] = nullptr;
+              continue;
+            }
+            ptr = order < 0 ? ptr->left_ : ptr->right_;
+          }
+          else if (!comp_(ptr->key_, *keys[i])) {
+            bound[i] = ptr;
+            ptr = ptr->left_;
+          }
+          else ptr = ptr->right_;
+          node[i] = ptr;
+          if (!IsNil(ptr)) {
+            _RBPrefetch(ptr);
+            running = true;
+          }
+        }
+      }
+      for (int i = 0; i < lanes; i++) {
+        if constexpr (!three_way)
+          if (!IsNil(bound[i]) && comp_(*keys[i], bound[i]->key_))
+            bound[i] = nullptr;
+        emit(bound[i]);
+      }
+    }
   }
 
   //////////////////////////////////////////////////////////////////
@@ -648,20 +2887,24 @@ private:
     node->right_ = Left(pivotEnd);
 
     if (pivotEnd->left_ != nullptr)
-      pivotEnd->left_->parent_ = node;
+      _Set_parent(pivotEnd->left_, node);
 
     // update the parent field of pivotEnd
-    pivotEnd->parent_ = Parent(node);
+    _Set_parent(pivotEnd, Parent(node));
 
     if (Parent(node) == nullptr) // node was root
       root = pivotEnd;
     else if (node == Left(Parent(node)))
-      node->parent_->left_ = pivotEnd; // join to the left
-    else node->parent_->right_ = pivotEnd; // else right
+      Parent(node)->left_ = pivotEnd; // join to the left
+    else Parent(node)->right_ = pivotEnd; // else right
     
     // join node to the left of pivotEnd
     pivotEnd->left_ = node;
-    node->parent_ = pivotEnd;
+    _Set_parent(node, pivotEnd);
+
+    // node is now below pivotEnd
+    _Update(node);
+    _Update(pivotEnd);
 
     // not required
     return pivotEnd;
@@ -689,17 +2932,19 @@ private:
     node->left_ = Right(pivotEnd);
     
     if (pivotEnd->right_ != nullptr)
-      pivotEnd->right_->parent_ = node;
-    pivotEnd->parent_ = Parent(node);
+      _Set_parent(pivotEnd->right_, node);
+    _Set_parent(pivotEnd, Parent(node));
 
     if (Parent(node) == nullptr)
       root = pivotEnd;
     else if (node == Left(Parent(node)))
-      node->parent_->left_ = pivotEnd;
-    else node->parent_->right_ = pivotEnd;
+      Parent(node)->left_ = pivotEnd;
+    else Parent(node)->right_ = pivotEnd;
 
     pivotEnd->right_ = node;
-    node->parent_ = pivotEnd;
+    _Set_parent(node, pivotEnd);
+    _Update(node);
+    _Update(pivotEnd);
     return pivotEnd;
   }
 
@@ -709,27 +2954,25 @@ private:
     pointer parent = nullptr;
     pointer itr = root;
 
+    bool left = false;
+
     // find the right place where node needs to be inserted
     while (itr != nullptr) {
       parent = itr;
-      if (node->key_ < itr->key_)
+      left = comp_(node->key_, itr->key_);
+      if (left)
         itr = itr->left_;
       else
         itr = itr->right_;
     }
-    node->parent_ = parent;
-    if (parent == nullptr)
-      root = node;
-    else if (Key(node) < Key(parent))
-      parent->left_ = node;
-    else parent->right_ = node;
-    _FixInsert(root, node);
-    size_++;
+    _Link(node, parent, left);
     return root;
   }
 
-  void _FixInsert(pointer &root, pointer node)
-  { // fixes the red-black properties disturbed due to insertion
+  bool _FixInsert(pointer &root, pointer node)
+  { // fixes the red-black properties disturbed due to insertion;
+    // true if the root had to be blackened, which adds one to the
+    // black height of the tree
     pointer uncle = nullptr;
     while (_Color(Parent(node)) == RED) {
       if (Parent(node) == Left(Parent(Parent(node)))) {
@@ -737,10 +2980,10 @@ private:
 
         // case 1: node's uncle is RED
         if (_Color(uncle) == RED) {
-          node->parent_->color_ = BLACK;
-          uncle->color_ = BLACK;
-          node->parent_->parent_->color_ = RED;
-          node = node->parent_->parent_;
+          _Set_color(Parent(node), BLACK);
+          _Set_color(uncle, BLACK);
+          _Set_color(Parent(Parent(node)), RED);
+          node = Parent(Parent(node));
         }
         // case 2 & 3: node's uncle is BLACK
         else {
@@ -751,9 +2994,9 @@ private:
           }
 
           // node is right or left child
-          node->parent_->color_ = BLACK;
-          node->parent_->parent_->color_ = RED;
-          RightRotate(root, node->parent_->parent_);
+          _Set_color(Parent(node), BLACK);
+          _Set_color(Parent(Parent(node)), RED);
+          RightRotate(root, Parent(Parent(node)));
         }
       }
       // right symmetry
@@ -761,10 +3004,10 @@ private:
         uncle = Left(Parent(Parent(node)));
 
         if (_Color(uncle) == RED) {
-          node->parent_->color_ = BLACK;
-          uncle->color_ = BLACK;
-          node->parent_->parent_->color_ = RED;
-          node = node->parent_->parent_;
+          _Set_color(Parent(node), BLACK);
+          _Set_color(uncle, BLACK);
+          _Set_color(Parent(Parent(node)), RED);
+          node = Parent(Parent(node));
         }
         else {
           if (node == Left(Parent(node))) {
@@ -772,13 +3015,15 @@ private:
             RightRotate(root, node);
           }
 
-          node->parent_->color_ = BLACK;
-          node->parent_->parent_->color_ = RED;
-          LeftRotate(root, node->parent_->parent_);
+          _Set_color(Parent(node), BLACK);
+          _Set_color(Parent(Parent(node)), RED);
+          LeftRotate(root, Parent(Parent(node)));
         }
       }
     } // while 
-    root->color_ = BLACK;
+    bool grew = _Color(root) == RED;
+    _Set_color(root, BLACK);
+    return grew;
   }
 
   void 
@@ -786,29 +3031,30 @@ private:
   { // swaps the links of the to nodes from and to
     pointer left = Left(from), right = Right(from), parent = Parent(from);
     Color c = _Color(from);
-    from->parent_ = Parent(to);
+    _Set_parent(from, Parent(to));
     from->left_ = Left(to);
     if (!IsNil(from->left_))
-      from->left_->parent_ = from;
+      _Set_parent(from->left_, from);
     from->right_ = Right(to);
     if (!IsNil(Right(from)))
-      from->right_->parent_ = from;
+      _Set_parent(from->right_, from);
     if (IsNil(Parent(to)))
-      root = from;
+      root_ = from;
     else if (to == Left(Parent(to)))
-      to->parent_->left_ = from;
+      Parent(to)->left_ = from;
     else
-      to->parent_->right_ = from;
-    from->color_ = _Color(to);
-    to->parent_ = parent;
+      Parent(to)->right_ = from;
+    _Set_color(from, _Color(to));
+    _Set_parent(to, parent);
     to->left_ = left;
     to->right_ = right;
-    to->color_ = c;
+    _Set_color(to, c);
+    _Update(from);
   }
 
   // deletion algorithm as described in CLRS except that 
-  // 1) A special node nil[T] may be made for deletion to
-  //    be accurate, rest is same
+  // 1) nil[T] is never materialized; when the spliced child is
+  //    null its parent is tracked instead and handed to the fixup
   // 2) Instead of copying data from the node, node is linked
   //    where it was needed to be copied
   pointer
@@ -816,7 +3062,13 @@ private:
   { // will delete the node from the tree root[T]
     pointer toDelete = nullptr;
     Color c = RED;
-    bool nil = false;
+
+    // the ends move to the neighbours of node; a node with two
+    // children is never one of them
+    if (node == header_.leftmost_)
+      header_.leftmost_ = _Next(node);
+    if (node == header_.rightmost_)
+      header_.rightmost_ = _Prev(node);
 
     // get the accurate node that needs to be deleted
     if (!IsNil(Left(node)) && !IsNil(Right(node))) // if both child exists
@@ -832,134 +3084,124 @@ private:
     else
       toFix = Right(toDelete); // split the right subtree
 
-    // if toFix was nullptr, then create a new node
-    // nil[T] whose color is black, and set nil = true
-    if (IsNil(toFix)) {
-      toFix = new NodeType();
-      toFix->color_ = BLACK;
-      nil = true;
-    }
+    // parent of toFix, kept separately since toFix may be nil[T]
+    pointer fixParent = Parent(toDelete);
 
-    toFix->parent_ = toDelete->parent_;
+    if (!IsNil(toFix))
+      _Set_parent(toFix, fixParent);
 
-    if (IsNil(Parent(toDelete)))  // if toDelete was root
+    if (IsNil(fixParent))  // if toDelete was root
       root = toFix;
-    else if (toDelete == Left(Parent(toDelete))) 
-      toDelete->parent_->left_ = toFix; // join the subtree
+    else if (toDelete == Left(fixParent)) 
+      fixParent->left_ = toFix; // join the subtree
     else
-      toDelete->parent_->right_ = toFix;
+      fixParent->right_ = toFix;
 
     c = _Color(toDelete);
 
     if (toDelete != node)  // if toDelete has atmost one child
     { // link the toDelete here
       _Transplant_satellite_data(toDelete, node);
+      if (fixParent == node)
+        fixParent = toDelete;
       std::swap(toDelete, node);
     }
 
+    // the subtrees shrank from the splice point up
+    _Update_path(fixParent);
+
     if (c == BLACK)
-      _Delete_Fixup(root, toFix);
-
-    // if nil node was created then we have to remove it
-    // otherwise memory would be wasted 
-    if (nil == true) {
-      // check the position of the toFix node
-      if (IsNil(Parent(toFix)))
-        root = nullptr;
-      else if (toFix == Left(Parent(toFix)))
-        toFix->parent_->left_ = nullptr;
-      else
-        toFix->parent_->right_ = nullptr;
+      _Delete_Fixup(root, toFix, fixParent);
 
-      // free the memory
-      delete toFix;
-    }
     size_--;
     return toDelete;
   }
 
-  void _Delete_Fixup(pointer &root, pointer node)
-  { // it fixes the RB properties if changed due to deletion
+  void _Delete_Fixup(pointer &root, pointer node, pointer parent)
+  { // it fixes the RB properties if changed due to deletion,
+    // node may be nil[T] so its parent is passed along with it
     pointer sibling = nullptr;
     while (node != root && _Color(node) == BLACK) {
-      if (node == Left(Parent(node))) {
-        sibling = Right(Parent(node));
+      if (node == Left(parent)) {
+        sibling = Right(parent);
         // case 1: node's sibling is RED
         if (_Color(sibling) == RED) {
-          sibling->color_ = BLACK;
-          node->parent_->color_ = RED;
-          LeftRotate(root, Parent(node));
-          sibling = Right(Parent(node));
+          _Set_color(sibling, BLACK);
+          _Set_color(parent, RED);
+          LeftRotate(root, parent);
+          sibling = Right(parent);
         } // now case 1 will be reduced to case 2, 3, or 4
 
         // case 2: node's sibling is BLACK,
         // both of sibling's children are BLACK,
         if (_Color(Left(sibling)) == BLACK &&
           _Color(Right(sibling)) == BLACK) {
-          sibling->color_ = RED;
-          node = node->parent_;
+          _Set_color(sibling, RED);
+          node = parent;
+          parent = Parent(node);
         }
         else {
           // case3 : sibling is BLACK, 
           // sibling's left child is RED, 
           // sibling's right child is BLACK
           if (_Color(Right(sibling)) == BLACK) {
-            sibling->left_->color_ = BLACK;
-            sibling->color_ = RED;
+            _Set_color(sibling->left_, BLACK);
+            _Set_color(sibling, RED);
             RightRotate(root, sibling);
-            sibling = Right(Parent(node));
+            sibling = Right(parent);
           }
 
           // case 4 : sibling is BLACK, 
           // sibling's right child is RED
-          sibling->color_ = _Color(Parent(node));
-          node->parent_->color_ = BLACK;
-          sibling->right_->color_ = BLACK;
-          LeftRotate(root, Parent(node));
+          _Set_color(sibling, _Color(parent));
+          _Set_color(parent, BLACK);
+          _Set_color(sibling->right_, BLACK);
+          LeftRotate(root, parent);
           node = root;
         }
       }
       else 
       { // case 5, 6, 7, and 8 are symmetrically 
         // opposite to case 1, 2, 3 and 4 resp.
-        sibling = Left(Parent(node));
+        sibling = Left(parent);
 
         // case 5
         if (_Color(sibling) == RED) {
-          sibling->color_ = BLACK;
-          node->parent_->color_ = RED;
-          RightRotate(root, Parent(node));
-          sibling = Left(Parent(node));
+          _Set_color(sibling, BLACK);
+          _Set_color(parent, RED);
+          RightRotate(root, parent);
+          sibling = Left(parent);
         }
 
         // case 6
         if (_Color(Right(sibling)) == BLACK
           && _Color(Left(sibling)) == BLACK) {
-          sibling->color_ = RED;
-          node = node->parent_;
+          _Set_color(sibling, RED);
+          node = parent;
+          parent = Parent(node);
         }
         else {
 
           // case 7
           if (_Color(Left(sibling)) == BLACK) {
-            sibling->right_->color_ = BLACK;
-            sibling->color_ = RED;
+            _Set_color(sibling->right_, BLACK);
+            _Set_color(sibling, RED);
             LeftRotate(root, sibling);
-            sibling = Left(Parent(node));
+            sibling = Left(parent);
           }
 
           // case 8
-          sibling->color_ = _Color(Parent(node));
-          node->parent_->color_ = BLACK;
-          sibling->left_->color_ = BLACK;
-          RightRotate(root, Parent(node));
+          _Set_color(sibling, _Color(parent));
+          _Set_color(parent, BLACK);
+          _Set_color(sibling->left_, BLACK);
+          RightRotate(root, parent);
           node = root;
         }
       }
     }
 
     if (!IsNil(node))
-      node->color_ = BLACK;
+      _Set_color(node, BLACK);
   }
 
   __ pointer _Min(pointer node) const
@@ -986,26 +3228,102 @@ private:
     return parent;
   }
 
-  __ pointer& Parent(pointer &node) const
+  __ pointer _Next(pointer node) const
+  { // in-order successor of node, nullptr after the maximum
+    if (!IsNil(Right(node)))
+      return _Min(Right(node));
+    pointer parent = Parent(node);
+    while (!IsNil(parent) && node == Right(parent)) {
+      node = parent;
+      parent = Parent(node);
+    }
+    return parent;
+  }
+
+  __ pointer _Prev(pointer node) const
+  { // in-order predecessor of node, nullptr before the minimum
+    if (!IsNil(Left(node)))
+      return _Max(Left(node));
+    pointer parent = Parent(node);
+    while (!IsNil(parent) && node == Left(parent)) {
+      node = parent;
+      parent = Parent(node);
+    }
+    return parent;
+  }
+
+  __ pointer Parent(const pointer &node) const
   { // get the parent of the node
-    return node->parent_;
+    return node->parent_._Ptr();
   }
 
-  __ pointer& Left(pointer &node) const
+  __ pointer& Left(const pointer &node) const
   { // get the left child of the node
     return node->left_;
   }
 
-  __ pointer& Right(pointer &node)
+  __ pointer& Right(const pointer &node) const
   { // get the roght child of the node
     return node->right_;
   }
 
   // as described in CLRS, we consider the null nodes
   // as nil[T] and color of these nodes is black
-  __ Color _Color(pointer &node)
+  __ Color _Color(const pointer &node) const
   { // get the color of the node
-    return !IsNil(node) ? node->color_ : Color::BLACK;
+    return !IsNil(node) ? node->parent_._Color() : Color::BLACK;
+  }
+
+  using _Aggregate = typename Traits::aggregate;
+  static constexpr bool _Has_aggregate =
+    !std::is_same<_Aggregate, RBNoAggregate>::value;
+  static constexpr bool _Augmented =
+    Traits::order_statistics || _Has_aggregate;
+
+  __ std::size_t _Count(const pointer &node) const
+  { // subtree size, 0 for nil[T]
+    if constexpr (Traits::order_statistics)
+      return IsNil(node) ? 0 : node->count_;
+    else
+      return 0;
+  }
+
+  template <typename P = _Aggregate>
+  __ typename P::value_type _Agg(const pointer &node) const
+  { // subtree aggregate, identity for nil[T]
+    return IsNil(node) ? P::identity() : node->agg_;
+  }
+
+  __ void _Update(const pointer &node)
+  { // recomputes the augmented fields of node from its children
+    if constexpr (Traits::order_statistics)
+      node->count_ = 1 + _Count(Left(node)) + _Count(Right(node));
+    if constexpr (_Has_aggregate)
+      node->agg_ = _Aggregate::combine(_Aggregate::combine(_Agg(Left(node)),
+        _Aggregate::lift(node->key_, node->data_)), _Agg(Right(node)));
+  }
+
+  __ void _Update_path(pointer node)
+  { // recomputes the augmented fields from node up to the root
+    if constexpr (_Augmented)
+      for (; !IsNil(node); node = Parent(node))
+        _Update(node);
+  }
+
+  __ void _Reset_ends()
+  { // looks up the cached minimum and maximum after a bulk change
+    header_.leftmost_ = _Min(root_);
+    header_.rightmost_ = _Max(root_);
+  }
+
+  __ void _Set_parent(const pointer &node, pointer parent)
+  { // set the parent of the node
+    node->parent_._Set_ptr(parent);
+  }
+
+  __ void _Set_color(const pointer &node, Color color)
+  { // set the color of a non-nil node
+    node->parent_._Set_color(color);
   }
 
   __ KeyType &Key(pointer &node) const 
@@ -1013,18 +3331,86 @@ private:
     return node->key_;
   }
 
-  __ bool IsNil(pointer &node) const
+  __ bool IsNil(const pointer &node) const
   { // returns true if node is nullptr
     return node == nullptr;
   }
 
-  __ pointer _Create_node(const KeyType &key, const DataType &data)
-  { // allocates memory for new node
-    return new NodeType(key, data);
+  template <typename... Args>
+  __ pointer _Create_node(Args&&... args)
+  { // allocates memory for new node from the node allocator
+    pointer node = node_traits::allocate(alloc_, 1);
+    try {
+      node_traits::construct(alloc_, node, std::forward<Args>(args)...);
+    }
+    catch (...) {
+      node_traits::deallocate(alloc_, node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  __ void _Destroy_node(pointer node)
+  { // destroys the node and returns its memory to the allocator
+    node_traits::destroy(alloc_, node);
+    node_traits::deallocate(alloc_, node, 1);
   }
 private:
-	RBNode<KeyType, DataType> *root_;
+	RBNode<KeyType, DataType, Traits> *root_;
   size_type size_;
+  Compare comp_;
+  node_allocator alloc_;
+
+  // cached minimum and maximum
+  _RBTree_header<NodeType> header_;
 };
 
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator, typename Traits>
+__ void swap(RBTree<KeyType, DataType, Compare, Allocator, Traits> &lhs,
+  RBTree<KeyType, DataType, Compare, Allocator, Traits> &rhs) noexcept
+{ // swaps two trees in O(1)
+  lhs.swap(rhs);
+}
+
+//////////////////////////////////////////////////////////////////
+//| Set algebra
+//|
+//| the trees are taken by value and their nodes reused: pass them
+//| with std::move to avoid copies. Keys must be unique. The work is
+//| O(m log(n / m + 1)) for sizes m <= n, and independent subtrees
+//| are processed on separate threads.
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator, typename Traits>
+RBTree<KeyType, DataType, Compare, Allocator, Traits>
+tree_union(RBTree<KeyType, DataType, Compare, Allocator, Traits> lhs,
+  RBTree<KeyType, DataType, Compare, Allocator, Traits> rhs)
+{ // elements of either tree, those of lhs for keys in both
+  using Tree = RBTree<KeyType, DataType, Compare, Allocator, Traits>;
+  return Tree::_Set_algebra(Tree::_Set_union, std::move(lhs), std::move(rhs));
+}
+
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator, typename Traits>
+RBTree<KeyType, DataType, Compare, Allocator, Traits>
+tree_intersection(RBTree<KeyType, DataType, Compare, Allocator, Traits> lhs,
+  RBTree<KeyType, DataType, Compare, Allocator, Traits> rhs)
+{ // elements of lhs whose key is also in rhs
+  using Tree = RBTree<KeyType, DataType, Compare, Allocator, Traits>;
+  return Tree::_Set_algebra(Tree::_Set_intersection, std::move(lhs),
+    std::move(rhs));
+}
+
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator, typename Traits>
+RBTree<KeyType, DataType, Compare, Allocator, Traits>
+tree_difference(RBTree<KeyType, DataType, Compare, Allocator, Traits> lhs,
+  RBTree<KeyType, DataType, Compare, Allocator, Traits> rhs)
+{ // elements of lhs whose key is not in rhs
+  using Tree = RBTree<KeyType, DataType, Compare, Allocator, Traits>;
+  return Tree::_Set_algebra(Tree::_Set_difference, std::move(lhs),
+    std::move(rhs));
+}
+
 #endif
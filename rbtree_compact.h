@@ -0,0 +1,803 @@
+#ifndef RBTREE_COMPACT_H_
+#define RBTREE_COMPACT_H_
+
+#include "rbtree.h"
+
+#include <cstring>
+
+// tag selecting the RBCompactTree constructor that loads an image
+// written by write_image
+struct RBCompactImageTag {
+  explicit RBCompactImageTag() = default;
+};
+constexpr RBCompactImageTag RBCompactImage{};
+
+//////////////////////////////////////////////////////////////////
+//| _RBCompact_node
+//|
+//| node of RBCompactTree, a slot of its node array. Links are
+//| 32-bit slot indices, 0 standing for nil[T]; the color is kept
+//| in bit 0 of the parent index. A free slot links to the next
+//| free one through left_.
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType>
+class _RBCompact_node {
+public:
+  using index_type = std::uint32_t;
+
+  template <typename K, typename D>
+  _RBCompact_node(K &&key, D &&data) :
+    left_(0), right_(0), parent_color_(RED),
+    key_(std::forward<K>(key)), data_(std::forward<D>(data))
+  { }
+
+  const KeyType &Key() const {
+    return key_;
+  }
+
+  DataType &Data() {
+    return data_;
+  }
+
+  const DataType &Data() const {
+    return data_;
+  }
+
+  index_type left_;
+  index_type right_;
+  index_type parent_color_;
+  KeyType key_;
+  DataType data_;
+};
+
+//////////////////////////////////////////////////////////////////
+//| RBCompactTree
+//|
+//| red-black tree whose nodes live in one growable array and link
+//| to each other by 32-bit index. Three indices and the color fit
+//| in 12 bytes where RBNode spends three pointers, the nodes sit
+//| together in memory, and erased slots are reused through a free
+//| list. Nothing in the array depends on where it is, so iterators
+//| survive growth, a copy is one copy of the array, and with
+//| trivially copyable keys and data write_image gives bytes that
+//| can be stored and loaded back with RBCompactImage.
+//|   RBCompactTree<int, int> tree;
+//|   tree.insert(1, 10);
+//|   std::vector<char> image(tree.image_size());
+//|   tree.write_image(image.data());
+//|   RBCompactTree<int, int> copy(RBCompactImage, image.data(),
+//|     image.size());
+//| The algorithms are those of RBTree; Traits::unique_keys applies,
+//| order statistics and aggregates are not available.
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType,
+  typename Compare = std::less<KeyType>,
+  typename Allocator = std::allocator<std::pair<const KeyType, DataType>>,
+  typename Traits = RBTreeTraits>
+class RBCompactTree {
+  static_assert(!Traits::order_statistics &&
+    std::is_same<typename Traits::aggregate, RBNoAggregate>::value,
+    "RBCompactTree keeps no subtree data");
+
+private:
+  template <bool Const>
+  class _Iterator;
+
+public:
+  using NodeType = _RBCompact_node<KeyType, DataType>;
+  using index_type = typename NodeType::index_type;
+  using size_type = std::size_t;
+  using key_compare = Compare;
+  using allocator_type = Allocator;
+  using iterator = _Iterator<false>;
+  using const_iterator = _Iterator<true>;
+  using insert_return_type = std::conditional_t<Traits::unique_keys,
+    std::pair<iterator, bool>, iterator>;
+
+  // bytes taken by one node, to compare with RBTree<...>::node_size
+  static constexpr std::size_t node_size = sizeof(NodeType);
+
+  // slots are numbered from 1; the color bit leaves 31 bits
+  static constexpr size_type max_nodes = (size_type(1) << 31) - 1;
+
+  RBCompactTree() :
+    root_(0), free_(0), size_(0), comp_()
+  { }
+
+  explicit RBCompactTree(const Compare &comp,
+    const Allocator &alloc = Allocator()) :
+    nodes_(node_allocator(alloc)), root_(0), free_(0), size_(0), comp_(comp)
+  { }
+
+  // a copy is a copy of the node array, no node is visited
+  RBCompactTree(const RBCompactTree &rhs) = default;
+  RBCompactTree &operator=(const RBCompactTree &rhs) = default;
+
+  RBCompactTree(RBCompactTree &&rhs) noexcept :
+    nodes_(std::move(rhs.nodes_)), root_(rhs.root_), free_(rhs.free_),
+    size_(rhs.size_), comp_(rhs.comp_)
+  { // steals the array of rhs, which is left empty
+    rhs.nodes_.clear();
+    rhs.root_ = rhs.free_ = 0;
+    rhs.size_ = 0;
+  }
+
+  RBCompactTree &operator=(RBCompactTree &&rhs)
+  {
+    if (this != &rhs) {
+      nodes_ = std::move(rhs.nodes_);
+      root_ = rhs.root_;
+      free_ = rhs.free_;
+      size_ = rhs.size_;
+      comp_ = rhs.comp_;
+      rhs.clear();
+    }
+    return *this;
+  }
+
+  void swap(RBCompactTree &rhs) noexcept
+  {
+    using std::swap;
+    nodes_.swap(rhs.nodes_);
+    swap(root_, rhs.root_);
+    swap(free_, rhs.free_);
+    swap(size_, rhs.size_);
+    swap(comp_, rhs.comp_);
+  }
+
+  RBCompactTree(RBCompactImageTag, const void *image, size_type bytes,
+    const Compare &comp = Compare(), const Allocator &alloc = Allocator()) :
+    nodes_(node_allocator(alloc)), comp_(comp)
+  { // loads the bytes of write_image; they must come from a tree of
+    // the same type built the same way
+    static_assert(std::is_trivially_copyable<NodeType>::value,
+      "images need trivially copyable keys and data");
+    _Image_header header;
+    if (bytes < sizeof(header))
+      throw THROW("image too short");
+    std::memcpy(&header, image, sizeof(header));
+    if (header.node_size != sizeof(NodeType) ||
+      header.slots > max_nodes ||
+      bytes != sizeof(header) + header.slots * sizeof(NodeType))
+      throw THROW("image does not match the tree");
+    nodes_.resize(header.slots, NodeType(KeyType(), DataType()));
+    std::memcpy(static_cast<void *>(nodes_.data()),
+      static_cast<const char *>(image) + sizeof(header),
+      header.slots * sizeof(NodeType));
+    // a stale or damaged file must not lead a walk out of the array:
+    // every index, free list included, is a slot or 0
+    index_type slots = static_cast<index_type>(header.slots);
+    if (header.root > slots || header.free > slots ||
+      header.size > header.slots)
+      throw THROW("image does not match the tree");
+    for (const NodeType &node : nodes_)
+      if (node.left_ > slots || node.right_ > slots ||
+        (node.parent_color_ >> 1) > slots)
+        throw THROW("image does not match the tree");
+    root_ = header.root;
+    free_ = header.free;
+    size_ = header.size;
+  }
+
+  size_type image_size() const
+  { // bytes written by write_image
+    return sizeof(_Image_header) + nodes_.size() * sizeof(NodeType);
+  }
+
+  void write_image(void *image) const
+  { // the node array, free slots included, after a small header
+    static_assert(std::is_trivially_copyable<NodeType>::value,
+      "images need trivially copyable keys and data");
+    _Image_header header = { sizeof(NodeType), nodes_.size(), size_,
+      root_, free_ };
+    std::memcpy(image, &header, sizeof(header));
+    if (!nodes_.empty())
+      std::memcpy(static_cast<char *>(image) + sizeof(header),
+        static_cast<const void *>(nodes_.data()),
+        nodes_.size() * sizeof(NodeType));
+  }
+
+  size_type size() const
+  { return size_; }
+
+  bool empty() const
+  { return size_ == 0; }
+
+  size_type capacity() const
+  { // slots available before the array grows
+    return nodes_.capacity();
+  }
+
+  void reserve(size_type count)
+  { nodes_.reserve(count); }
+
+  key_compare key_comp() const
+  { return comp_; }
+
+  allocator_type get_allocator() const
+  { return allocator_type(nodes_.get_allocator()); }
+
+  void clear()
+  { // drops every slot, the array keeps its capacity
+    nodes_.clear();
+    root_ = free_ = 0;
+    size_ = 0;
+  }
+
+  insert_return_type insert(const KeyType &key, const DataType &data)
+  {
+    return _Insert(key, data);
+  }
+
+  insert_return_type insert(std::pair<KeyType, DataType> &&p)
+  {
+    return _Insert(std::move(p.first), std::move(p.second));
+  }
+
+  template <typename D>
+  std::pair<iterator, bool> insert_or_assign(const KeyType &key, D &&data)
+  { // one descent: assigns if key exists, links a node otherwise
+    index_type parent = 0, exists = 0;
+    bool left = false;
+    _Insert_pos(key, parent, left, exists);
+    if (exists != 0) {
+      _At(exists).data_ = std::forward<D>(data);
+      return { iterator(this, exists), false };
+    }
+    return { iterator(this, _Link(key, std::forward<D>(data), parent, left)),
+      true };
+  }
+
+  DataType &operator[](const KeyType &key)
+  { // data of key, inserted default constructed if absent
+    index_type parent = 0, exists = 0;
+    bool left = false;
+    _Insert_pos(key, parent, left, exists);
+    if (exists == 0)
+      exists = _Link(key, DataType(), parent, left);
+    return _At(exists).data_;
+  }
+
+  iterator search(const KeyType &key)
+  { return iterator(this, _Search(key)); }
+
+  const_iterator search(const KeyType &key) const
+  { return const_iterator(this, _Search(key)); }
+
+  iterator lower_bound(const KeyType &key)
+  { return iterator(this, _Lower_bound(key)); }
+
+  const_iterator lower_bound(const KeyType &key) const
+  { return const_iterator(this, _Lower_bound(key)); }
+
+  iterator upper_bound(const KeyType &key)
+  { return iterator(this, _Upper_bound(key)); }
+
+  const_iterator upper_bound(const KeyType &key) const
+  { return const_iterator(this, _Upper_bound(key)); }
+
+  template <typename Fn>
+  void for_each_in_range(const KeyType &lo, const KeyType &hi, Fn &&fn) const
+  { // calls fn(key, data) for every element with key in [lo, hi)
+    for (index_type node = _Lower_bound(lo);
+      node != 0 && comp_(_At(node).key_, hi); node = _Next(node))
+      fn(static_cast<const KeyType &>(_At(node).key_),
+        static_cast<const DataType &>(_At(node).data_));
+  }
+
+  void erase(const KeyType &key)
+  { // erases an element with key equivalent to key, if any
+    index_type node = _Search(key);
+    if (node != 0)
+      _Erase(node);
+  }
+
+  void erase(const iterator &it)
+  { // other iterators stay valid: nodes are relinked, not copied
+    _Erase(it.index_);
+  }
+
+  iterator begin()
+  { return iterator(this, _Min(root_)); }
+
+  iterator end()
+  { return iterator(this, 0); }
+
+  const_iterator begin() const
+  { return const_iterator(this, _Min(root_)); }
+
+  const_iterator end() const
+  { return const_iterator(this, 0); }
+
+  const_iterator cbegin() const
+  { return begin(); }
+
+  const_iterator cend() const
+  { return end(); }
+
+private:
+  using node_allocator = typename std::allocator_traits<Allocator>::
+    template rebind_alloc<NodeType>;
+
+  struct _Image_header {
+    std::uint64_t node_size;
+    std::uint64_t slots;
+    std::uint64_t size;
+    index_type root;
+    index_type free;
+  };
+
+  template <bool Const>
+  class _Iterator {
+    friend class RBCompactTree;
+    using tree_pointer = std::conditional_t<Const,
+      const RBCompactTree *, RBCompactTree *>;
+
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = NodeType;
+    using difference_type = std::ptrdiff_t;
+    using reference = std::conditional_t<Const, const NodeType &, NodeType &>;
+    using pointer = std::conditional_t<Const, const NodeType *, NodeType *>;
+
+    _Iterator() :
+      tree_(nullptr), index_(0)
+    { }
+
+    _Iterator(tree_pointer tree, index_type index) :
+      tree_(tree), index_(index)
+    { }
+
+    template <bool C = Const, typename = std::enable_if_t<C>>
+    _Iterator(const _Iterator<false> &rhs) :
+      tree_(rhs.tree_), index_(rhs.index_)
+    { }
+
+    reference operator*() const
+    { return tree_->_At(index_); }
+
+    pointer operator->() const
+    { return &tree_->_At(index_); }
+
+    _Iterator &operator++()
+    { // end() stays at end()
+      if (index_ != 0)
+        index_ = tree_->_Next(index_);
+      return *this;
+    }
+
+    _Iterator operator++(int)
+    {
+      _Iterator old = *this;
+      ++(*this);
+      return old;
+    }
+
+    _Iterator &operator--()
+    { // end() steps to the maximum
+      index_ = index_ == 0 ? tree_->_Max(tree_->root_) :
+        tree_->_Prev(index_);
+      return *this;
+    }
+
+    _Iterator operator--(int)
+    {
+      _Iterator old = *this;
+      --(*this);
+      return old;
+    }
+
+    bool operator==(const _Iterator &rhs) const
+    { return index_ == rhs.index_; }
+
+    bool operator!=(const _Iterator &rhs) const
+    { return index_ != rhs.index_; }
+
+  private:
+    friend class _Iterator<!Const>;
+
+    tree_pointer tree_;
+    index_type index_;
+  };
+
+  __ NodeType &_At(index_type index)
+  { return nodes_[index - 1]; }
+
+  __ const NodeType &_At(index_type index) const
+  { return nodes_[index - 1]; }
+
+  __ index_type &_Left(index_type node)
+  { return _At(node).left_; }
+
+  __ index_type &_Right(index_type node)
+  { return _At(node).right_; }
+
+  __ index_type _Left(index_type node) const
+  { return _At(node).left_; }
+
+  __ index_type _Right(index_type node) const
+  { return _At(node).right_; }
+
+  __ index_type _Parent(index_type node) const
+  { return _At(node).parent_color_ >> 1; }
+
+  __ void _Set_parent(index_type node, index_type parent)
+  {
+    index_type &bits = _At(node).parent_color_;
+    bits = (parent << 1) | (bits & 1);
+  }
+
+  __ bool _Is_red(index_type node) const
+  { // nil[T] is black
+    return node != 0 && (_At(node).parent_color_ & 1) == RED;
+  }
+
+  __ void _Set_color(index_type node, Color color)
+  {
+    index_type &bits = _At(node).parent_color_;
+    bits = (bits & ~index_type(1)) | color;
+  }
+
+  __ index_type _Min(index_type node) const
+  {
+    if (node != 0)
+      while (_Left(node) != 0)
+        node = _Left(node);
+    return node;
+  }
+
+  __ index_type _Max(index_type node) const
+  {
+    if (node != 0)
+      while (_Right(node) != 0)
+        node = _Right(node);
+    return node;
+  }
+
+  index_type _Next(index_type node) const
+  { // in-order successor, 0 after the maximum
+    if (_Right(node) != 0)
+      return _Min(_Right(node));
+    index_type parent = _Parent(node);
+    while (parent != 0 && node == _Right(parent)) {
+      node = parent;
+      parent = _Parent(node);
+    }
+    return parent;
+  }
+
+  index_type _Prev(index_type node) const
+  { // in-order predecessor, 0 before the minimum
+    if (_Left(node) != 0)
+      return _Max(_Left(node));
+    index_type parent = _Parent(node);
+    while (parent != 0 && node == _Left(parent)) {
+      node = parent;
+      parent = _Parent(node);
+    }
+    return parent;
+  }
+
+  index_type _Search(const KeyType &key) const
+  { // one Compare call per level, as in RBTree::_Search
+    index_type bound = _Lower_bound(key);
+    if (bound != 0 && comp_(key, _At(bound).key_))
+      return 0;
+    return bound;
+  }
+
+  index_type _Lower_bound(const KeyType &key) const
+  {
+    index_type node = root_, bound = 0;
+    while (node != 0) {
+      if (!comp_(_At(node).key_, key)) {
+        bound = node;
+        node = _Left(node);
+      }
+      else node = _Right(node);
+    }
+    return bound;
+  }
+
+  index_type _Upper_bound(const KeyType &key) const
+  {
+    index_type node = root_, bound = 0;
+    while (node != 0) {
+      if (comp_(key, _At(node).key_)) {
+        bound = node;
+        node = _Left(node);
+      }
+      else node = _Right(node);
+    }
+    return bound;
+  }
+
+  void _Insert_pos(const KeyType &key, index_type &parent, bool &left,
+    index_type &exists) const
+  { // where key would be linked; exists is an equivalent node, set
+    // only with unique keys or from insert_or_assign. Equal keys go
+    // right, after those already present
+    index_type node = root_, last_right = 0;
+    parent = 0;
+    while (node != 0) {
+      parent = node;
+      left = comp_(key, _At(node).key_);
+      if (left)
+        node = _Left(node);
+      else {
+        last_right = node;
+        node = _Right(node);
+      }
+    }
+    exists = last_right != 0 && !comp_(_At(last_right).key_, key) ?
+      last_right : 0;
+  }
+
+  template <typename K, typename D>
+  insert_return_type _Insert(K &&key, D &&data)
+  {
+    index_type parent = 0, exists = 0;
+    bool left = false;
+    _Insert_pos(key, parent, left, exists);
+    if constexpr (Traits::unique_keys) {
+      if (exists != 0)
+        return { iterator(this, exists), false };
+      return { iterator(this, _Link(std::forward<K>(key),
+        std::forward<D>(data), parent, left)), true };
+    }
+    else
+      return iterator(this, _Link(std::forward<K>(key),
+        std::forward<D>(data), parent, left));
+  }
+
+  template <typename K, typename D>
+  index_type _Allocate(K &&key, D &&data)
+  { // a free slot if there is one, else a new one at the end of the
+    // array; the array may move, indices don't
+    if (free_ != 0) {
+      index_type node = free_;
+      NodeType &slot = _At(node);
+      slot.key_ = std::forward<K>(key);
+      slot.data_ = std::forward<D>(data);
+      free_ = slot.left_;
+      slot.left_ = slot.right_ = 0;
+      slot.parent_color_ = RED;
+      return node;
+    }
+    if (nodes_.size() == max_nodes)
+      throw THROW("RBCompactTree is full");
+    nodes_.emplace_back(std::forward<K>(key), std::forward<D>(data));
+    return static_cast<index_type>(nodes_.size());
+  }
+
+  void _Free(index_type node)
+  { // pushes the slot onto the free list; its element is reset so
+    // that whatever it owns is given back now
+    NodeType &slot = _At(node);
+    if constexpr (std::is_default_constructible<KeyType>::value &&
+      std::is_default_constructible<DataType>::value) {
+      slot.key_ = KeyType();
+      slot.data_ = DataType();
+    }
+    slot.left_ = free_;
+    slot.right_ = 0;
+    slot.parent_color_ = BLACK;
+    free_ = node;
+  }
+
+  template <typename K, typename D>
+  index_type _Link(K &&key, D &&data, index_type parent, bool left)
+  { // links a new red node below parent and rebalances
+    index_type node = _Allocate(std::forward<K>(key), std::forward<D>(data));
+    _Set_parent(node, parent);
+    if (parent == 0)
+      root_ = node;
+    else if (left)
+      _Left(parent) = node;
+    else
+      _Right(parent) = node;
+    ++size_;
+    _Insert_fixup(node);
+    return node;
+  }
+
+  void _Rotate_left(index_type node)
+  {
+    index_type pivot = _Right(node), parent = _Parent(node);
+    _Right(node) = _Left(pivot);
+    if (_Left(pivot) != 0)
+      _Set_parent(_Left(pivot), node);
+    _Set_parent(pivot, parent);
+    if (parent == 0)
+      root_ = pivot;
+    else if (node == _Left(parent))
+      _Left(parent) = pivot;
+    else
+      _Right(parent) = pivot;
+    _Left(pivot) = node;
+    _Set_parent(node, pivot);
+  }
+
+  void _Rotate_right(index_type node)
+  {
+    index_type pivot = _Left(node), parent = _Parent(node);
+    _Left(node) = _Right(pivot);
+    if (_Right(pivot) != 0)
+      _Set_parent(_Right(pivot), node);
+    _Set_parent(pivot, parent);
+    if (parent == 0)
+      root_ = pivot;
+    else if (node == _Right(parent))
+      _Right(parent) = pivot;
+    else
+      _Left(parent) = pivot;
+    _Right(pivot) = node;
+    _Set_parent(node, pivot);
+  }
+
+  void _Insert_fixup(index_type node)
+  { // CLRS RB-INSERT-FIXUP
+    while (_Is_red(_Parent(node))) {
+      index_type parent = _Parent(node), grand = _Parent(parent);
+      if (parent == _Left(grand)) {
+        index_type uncle = _Right(grand);
+        if (_Is_red(uncle)) {
+          _Set_color(parent, BLACK);
+          _Set_color(uncle, BLACK);
+          _Set_color(grand, RED);
+          node = grand;
+          continue;
+        }
+        if (node == _Right(parent)) {
+          node = parent;
+          _Rotate_left(node);
+          parent = _Parent(node);
+        }
+        _Set_color(parent, BLACK);
+        _Set_color(grand, RED);
+        _Rotate_right(grand);
+      }
+      else {
+        index_type uncle = _Left(grand);
+        if (_Is_red(uncle)) {
+          _Set_color(parent, BLACK);
+          _Set_color(uncle, BLACK);
+          _Set_color(grand, RED);
+          node = grand;
+          continue;
+        }
+        if (node == _Left(parent)) {
+          node = parent;
+          _Rotate_right(node);
+          parent = _Parent(node);
+        }
+        _Set_color(parent, BLACK);
+        _Set_color(grand, RED);
+        _Rotate_left(grand);
+      }
+    }
+    _Set_color(root_, BLACK);
+  }
+
+  void _Transplant(index_type node, index_type child)
+  { // puts child where node is; nil[T] has no slot to take a parent
+    index_type parent = _Parent(node);
+    if (parent == 0)
+      root_ = child;
+    else if (node == _Left(parent))
+      _Left(parent) = child;
+    else
+      _Right(parent) = child;
+    if (child != 0)
+      _Set_parent(child, parent);
+  }
+
+  void _Erase(index_type node)
+  { // CLRS RB-DELETE, relinking the successor instead of copying
+    // its element; the parent of the spliced child is tracked since
+    // nil[T] can't hold it
+    index_type child, parent;
+    bool black = !_Is_red(node);
+    if (_Left(node) == 0 || _Right(node) == 0) {
+      child = _Left(node) != 0 ? _Left(node) : _Right(node);
+      parent = _Parent(node);
+      _Transplant(node, child);
+    }
+    else {
+      index_type next = _Min(_Right(node));
+      black = !_Is_red(next);
+      child = _Right(next);
+      if (_Parent(next) == node)
+        parent = next;
+      else {
+        parent = _Parent(next);
+        _Transplant(next, child);
+        _Right(next) = _Right(node);
+        _Set_parent(_Right(next), next);
+      }
+      _Transplant(node, next);
+      _Left(next) = _Left(node);
+      _Set_parent(_Left(next), next);
+      _Set_color(next, _Is_red(node) ? RED : BLACK);
+    }
+    if (black)
+      _Erase_fixup(child, parent);
+    _Free(node);
+    --size_;
+  }
+
+  void _Erase_fixup(index_type node, index_type parent)
+  { // CLRS RB-DELETE-FIXUP; node may be nil[T], below parent
+    while (node != root_ && !_Is_red(node)) {
+      if (node == _Left(parent)) {
+        index_type sibling = _Right(parent);
+        if (_Is_red(sibling)) {
+          _Set_color(sibling, BLACK);
+          _Set_color(parent, RED);
+          _Rotate_left(parent);
+          sibling = _Right(parent);
+        }
+        if (!_Is_red(_Left(sibling)) && !_Is_red(_Right(sibling))) {
+          _Set_color(sibling, RED);
+          node = parent;
+          parent = _Parent(node);
+          continue;
+        }
+        if (!_Is_red(_Right(sibling))) {
+          _Set_color(_Left(sibling), BLACK);
+          _Set_color(sibling, RED);
+          _Rotate_right(sibling);
+          sibling = _Right(parent);
+        }
+        _Set_color(sibling, _Is_red(parent) ? RED : BLACK);
+        _Set_color(parent, BLACK);
+        _Set_color(_Right(sibling), BLACK);
+        _Rotate_left(parent);
+      }
+      else {
+        index_type sibling = _Left(parent);
+        if (_Is_red(sibling)) {
+          _Set_color(sibling, BLACK);
+          _Set_color(parent, RED);
+          _Rotate_right(parent);
+          sibling = _Left(parent);
+        }
+        if (!_Is_red(_Left(sibling)) && !_Is_red(_Right(sibling))) {
+          _Set_color(sibling, RED);
+          node = parent;
+          parent = _Parent(node);
+          continue;
+        }
+        if (!_Is_red(_Left(sibling))) {
+          _Set_color(_Right(sibling), BLACK);
+          _Set_color(sibling, RED);
+          _Rotate_left(sibling);
+          sibling = _Left(parent);
+        }
+        _Set_color(sibling, _Is_red(parent) ? RED : BLACK);
+        _Set_color(parent, BLACK);
+        _Set_color(_Left(sibling), BLACK);
+        _Rotate_right(parent);
+      }
+      node = root_;
+    }
+    if (node != 0)
+      _Set_color(node, BLACK);
+  }
+
+  std::vector<NodeType, node_allocator> nodes_; // slot i at nodes_[i - 1]
+  index_type root_;
+  index_type free_;
+  size_type size_;
+  Compare comp_;
+};
+
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator, typename Traits>
+void swap(RBCompactTree<KeyType, DataType, Compare, Allocator, Traits> &lhs,
+  RBCompactTree<KeyType, DataType, Compare, Allocator, Traits> &rhs) noexcept
+{
+  lhs.swap(rhs);
+}
+
+#endif
@@ -0,0 +1,364 @@
+#ifndef RBTREE_CONCURRENT_H_
+#define RBTREE_CONCURRENT_H_
+
+#include "rbtree_cow.h"
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+//////////////////////////////////////////////////////////////////
+//| RBEpochDomain
+//|
+//| epoch-based reclamation. A reader announces the global epoch in
+//| a slot of its own for as long as it looks at the tree. Nodes
+//| retired at epoch E are freed once no slot announces an epoch
+//| <= E: a reader that announced later loaded the root after the
+//| nodes were unlinked, so it cannot reach them. Slots are padded
+//| to a cache line each, so readers never write to a shared line.
+//////////////////////////////////////////////////////////////////
+class RBEpochDomain {
+  struct alignas(64) _Slot {
+    std::atomic<std::uint64_t> epoch_{ 0 };
+  };
+
+public:
+  // a reader needs a free slot; with at least as many slots as
+  // threads reading at once, claiming one never waits
+  explicit RBEpochDomain(std::size_t slots =
+    4 * std::max(16u, std::thread::hardware_concurrency())) :
+    slots_(new _Slot[slots]), count_(slots)
+  { }
+
+  RBEpochDomain(const RBEpochDomain &) = delete;
+  RBEpochDomain &operator=(const RBEpochDomain &) = delete;
+
+  class guard {
+  public:
+    explicit guard(RBEpochDomain &domain) :
+      slot_(domain._Enter())
+    { }
+
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+
+    ~guard()
+    { slot_->epoch_.store(0, std::memory_order_release); }
+
+  private:
+    _Slot *slot_;
+  };
+
+  std::uint64_t advance()
+  { // closes the current epoch and returns it
+    return epoch_.fetch_add(1);
+  }
+
+  std::uint64_t oldest_active() const
+  { // smallest epoch announced by a reader, or the maximum
+    std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+    for (std::size_t i = 0; i < count_; i++) {
+      std::uint64_t epoch = slots_[i].epoch_.load();
+      if (epoch != 0 && epoch < oldest)
+        oldest = epoch;
+    }
+    return oldest;
+  }
+
+private:
+  _Slot *_Enter()
+  { // claims a free slot, starting from one picked by thread id so
+    // that threads usually find theirs at the first try
+    static thread_local std::size_t start =
+      std::hash<std::thread::id>()(std::this_thread::get_id());
+    for (std::size_t i = start;; i++) {
+      _Slot &slot = slots_[i % count_];
+      std::uint64_t idle = 0;
+      if (slot.epoch_.load(std::memory_order_relaxed) == 0 &&
+        slot.epoch_.compare_exchange_strong(idle, epoch_.load())) {
+        start = i;
+        return &slot;
+      }
+    }
+  }
+
+  std::unique_ptr<_Slot[]> slots_;
+  std::size_t count_;
+  alignas(64) std::atomic<std::uint64_t> epoch_{ 1 };
+};
+
+//////////////////////////////////////////////////////////////////
+//| RBConcurrentTree
+//|
+//| ordered map with lock-free readers and writers serialized by a
+//| mutex. A write builds the next version by path copying (see
+//| _RBCow_core) and publishes its root with one atomic store, so a
+//| reader sees either the old or the new version, complete. The
+//| nodes the write replaced are retired to an RBEpochDomain and
+//| freed once no reader can still be looking at them.
+//|   RBConcurrentTree<int, std::string> tree;
+//|   tree.insert(1, "one");              // any thread
+//|   auto data = tree.search(1);         // any thread, no locks
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType,
+  typename Compare = std::less<KeyType>,
+  typename Allocator = std::allocator<std::pair<const KeyType, DataType>>>
+class RBConcurrentTree : private _RBCow_core<
+  RBConcurrentTree<KeyType, DataType, Compare, Allocator>,
+  _RBCow_node<KeyType, DataType, false>, Compare> {
+  using _Base = _RBCow_core<RBConcurrentTree,
+    _RBCow_node<KeyType, DataType, false>, Compare>;
+  friend _Base;
+
+public:
+  using NodeType = _RBCow_node<KeyType, DataType, false>;
+  using pointer = NodeType *;
+  using size_type = std::size_t;
+  using key_compare = Compare;
+  using allocator_type = Allocator;
+
+  explicit RBConcurrentTree(const Compare &comp = Compare(),
+    const Allocator &alloc = Allocator()) :
+    _Base(comp), root_(nullptr), size_(0), alloc_(alloc)
+  { // reserved once, so recording a replaced node never allocates
+    released_.reserve(_Base::_Max_replaced);
+  }
+
+  RBConcurrentTree(const RBConcurrentTree &) = delete;
+  RBConcurrentTree &operator=(const RBConcurrentTree &) = delete;
+
+  ~RBConcurrentTree()
+  { // no reader may be left, everything is freed right away
+    _Free_all(root_.load());
+    for (auto &batch : limbo_)
+      for (pointer node : batch.second)
+        _Destroy_node(node);
+  }
+
+  using _Base::key_comp;
+
+  allocator_type get_allocator() const
+  { return allocator_type(alloc_); }
+
+  // readers: lock-free, from any thread at any time
+
+  template <typename K>
+  std::optional<DataType> search(const K &key) const
+  { // copy of the data for key, if present
+    RBEpochDomain::guard guard(domain_);
+    pointer node = this->_Find(root_.load(), key);
+    if (node == nullptr)
+      return std::nullopt;
+    return node->data_;
+  }
+
+  template <typename K>
+  bool contains(const K &key) const
+  {
+    RBEpochDomain::guard guard(domain_);
+    return this->_Find(root_.load(), key) != nullptr;
+  }
+
+  template <typename K, typename Fn>
+  bool visit(const K &key, Fn fn) const
+  { // calls fn(data) in place, without copying; false if absent
+    RBEpochDomain::guard guard(domain_);
+    pointer node = this->_Find(root_.load(), key);
+    if (node == nullptr)
+      return false;
+    fn(static_cast<const DataType &>(node->data_));
+    return true;
+  }
+
+  template <typename K, typename Fn>
+  void for_each_in_range(const K &lo, const K &hi, Fn fn) const
+  { // calls fn(key, data) for every key in [lo, hi), all from the
+    // same version of the tree
+    RBEpochDomain::guard guard(domain_);
+    this->_Range(root_.load(), lo, hi, fn);
+  }
+
+  size_type size() const
+  { return size_.load(std::memory_order_relaxed); }
+
+  bool empty() const
+  { return root_.load() == nullptr; }
+
+  // writers: serialized by a mutex
+
+  template <typename K, typename D>
+  bool insert(K &&key, D &&data)
+  { // adds key unless present; true if it was added
+    std::lock_guard<std::mutex> lock(writer_);
+    pointer root = root_.load(std::memory_order_relaxed);
+    released_.clear();
+    bool inserted = this->_Cow_insert(root, std::forward<K>(key),
+      std::forward<D>(data), false);
+    _Publish(root, inserted ? 1 : 0);
+    return inserted;
+  }
+
+  template <typename K, typename D>
+  bool insert_or_assign(K &&key, D &&data)
+  { // adds key or replaces its data; true if it was added
+    std::lock_guard<std::mutex> lock(writer_);
+    pointer root = root_.load(std::memory_order_relaxed);
+    released_.clear();
+    bool inserted = this->_Cow_insert(root, std::forward<K>(key),
+      std::forward<D>(data), true);
+    _Publish(root, inserted ? 1 : 0);
+    return inserted;
+  }
+
+  template <typename K>
+  bool erase(const K &key)
+  { // true if key was present
+    std::lock_guard<std::mutex> lock(writer_);
+    pointer root = root_.load(std::memory_order_relaxed);
+    released_.clear();
+    bool erased = this->_Cow_erase(root, key);
+    _Publish(root, erased ? -1 : 0);
+    return erased;
+  }
+
+  void clear()
+  { // unpublishes the whole tree, its nodes are retired
+    std::lock_guard<std::mutex> lock(writer_);
+    pointer root = root_.load(std::memory_order_relaxed);
+    if (root == nullptr)
+      return;
+    std::vector<pointer> nodes;
+    _Collect(root, nodes);
+    limbo_.emplace_back(_Unretired, std::move(nodes));
+    root_.store(nullptr);
+    size_.store(0, std::memory_order_relaxed);
+    limbo_.back().first = domain_.advance();
+    _Reclaim();
+  }
+
+  void reclaim()
+  { // frees the retired nodes no reader can reach; every write
+    // does this too
+    std::lock_guard<std::mutex> lock(writer_);
+    _Reclaim();
+  }
+
+private:
+  using node_allocator = typename std::allocator_traits<Allocator>::
+    template rebind_alloc<NodeType>;
+  using node_traits = std::allocator_traits<node_allocator>;
+
+  // epoch of a limbo batch whose nodes are still published; no
+  // reader is older, so _Reclaim leaves it alone
+  static constexpr std::uint64_t _Unretired =
+    std::numeric_limits<std::uint64_t>::max();
+
+  void _Publish(pointer root, int change)
+  { // makes root the current version, changing the size by change,
+    // and retires what it replaced. The limbo batch is made before
+    // the store, so nothing after it can throw; if making it throws,
+    // the new version is freed and the tree stays as it was
+    if (root == root_.load(std::memory_order_relaxed))
+      return; // nothing changed
+    bool retire = !released_.empty();
+    if (retire) {
+      try {
+        limbo_.emplace_back(_Unretired, std::vector<pointer>(
+          released_.begin(), released_.end()));
+      }
+      catch (...) {
+        this->_For_fresh(root, [this](pointer node) { _Destroy_node(node); });
+        throw;
+      }
+    }
+    root_.store(root);
+    if (change > 0)
+      size_.fetch_add(1, std::memory_order_relaxed);
+    else if (change < 0)
+      size_.fetch_sub(1, std::memory_order_relaxed);
+    if (retire) {
+      limbo_.back().first = domain_.advance();
+      released_.clear();
+    }
+    _Reclaim();
+  }
+
+  void _Reclaim()
+  { // batches retired before the oldest reader's epoch are free
+    std::uint64_t oldest = domain_.oldest_active();
+    while (!limbo_.empty() && limbo_.front().first < oldest) {
+      for (pointer node : limbo_.front().second)
+        _Destroy_node(node);
+      limbo_.pop_front();
+    }
+  }
+
+  void _Collect(pointer root, std::vector<pointer> &nodes)
+  { // every node of a version, for retiring it whole
+    if (root != nullptr)
+      nodes.push_back(root);
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+      if (nodes[i]->left_ != nullptr)
+        nodes.push_back(nodes[i]->left_);
+      if (nodes[i]->right_ != nullptr)
+        nodes.push_back(nodes[i]->right_);
+    }
+  }
+
+  void _Free_all(pointer root)
+  {
+    std::vector<pointer> nodes;
+    _Collect(root, nodes);
+    for (pointer node : nodes)
+      _Destroy_node(node);
+  }
+
+  // hooks of _RBCow_core, called under writer_
+
+  template <typename... Args>
+  pointer _Allocate(Args&&... args)
+  {
+    pointer node = node_traits::allocate(alloc_, 1);
+    try {
+      node_traits::construct(alloc_, node, this->stamp_,
+        std::forward<Args>(args)...);
+    }
+    catch (...) {
+      node_traits::deallocate(alloc_, node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  template <typename K, typename D>
+  pointer _Create(K &&key, D &&data)
+  { return _Allocate(std::forward<K>(key), std::forward<D>(data)); }
+
+  pointer _Copy(pointer node)
+  { return _Allocate(*node); }
+
+  void _Destroy_node(pointer node)
+  {
+    node_traits::destroy(alloc_, node);
+    node_traits::deallocate(alloc_, node, 1);
+  }
+
+  void _Replaced(pointer node)
+  { // readers may still be on it, it is retired by _Publish
+    released_.push_back(node);
+  }
+
+  // read by every reader, written once per write
+  alignas(64) std::atomic<pointer> root_;
+  std::atomic<size_type> size_;
+
+  alignas(64) std::mutex writer_;
+  node_allocator alloc_;
+  std::vector<pointer> released_; // replaced by the current write
+  std::deque<std::pair<std::uint64_t, std::vector<pointer>>> limbo_;
+  mutable RBEpochDomain domain_;
+};
+
+#endif
@@ -0,0 +1,425 @@
+#ifndef RBTREE_COW_H_
+#define RBTREE_COW_H_
+
+#include "rbtree.h"
+
+#include <atomic>
+#include <cstdint>
+
+//////////////////////////////////////////////////////////////////
+//| _RBCow_node
+//|
+//| node of the copy-on-write trees: no parent link, so a node can
+//| be shared by several versions. A node is never changed once a
+//| write has finished with it; stamp_ tells which write made it.
+//| The reference count exists only for the persistent tree.
+//////////////////////////////////////////////////////////////////
+template <bool Counted>
+class _RBCow_refs {
+public:
+  std::atomic<std::size_t> refs_{ 1 };
+};
+
+template <>
+class _RBCow_refs<false> { };
+
+template <typename KeyType, typename DataType, bool Counted>
+class _RBCow_node : public _RBCow_refs<Counted> {
+public:
+  template <typename K, typename D>
+  _RBCow_node(std::uint64_t stamp, K &&key, D &&data) :
+    left_(nullptr), right_(nullptr), stamp_(stamp), color_(RED),
+    key_(std::forward<K>(key)), data_(std::forward<D>(data))
+  { }
+
+  _RBCow_node(std::uint64_t stamp, const _RBCow_node &node) :
+    left_(node.left_), right_(node.right_), stamp_(stamp),
+    color_(node.color_), key_(node.key_), data_(node.data_)
+  { // copy of node for a new version, sharing its children
+  }
+
+  const KeyType &Key() const {
+    return key_;
+  }
+
+  const DataType &Data() const {
+    return data_;
+  }
+
+  _RBCow_node *left_;
+  _RBCow_node *right_;
+  std::uint64_t stamp_;
+  Color color_;
+  KeyType key_;
+  DataType data_;
+};
+
+//////////////////////////////////////////////////////////////////
+//| _RBCow_core
+//|
+//| red-black insert and erase by path copying. A write copies the
+//| nodes it is about to change (those on the search path, plus
+//| the siblings touched by the fixups) and leaves every node of
+//| the previous version as it was, so readers of that version are
+//| never disturbed. Without parent links the path is kept on a
+//| stack. Derived supplies
+//|   _Create(key, data)   node stamped with stamp_
+//|   _Copy(node)          copy of node stamped with stamp_
+//|   _Destroy_node(node)  frees a node no version has seen
+//|   _Replaced(node)      node of an older version that a copy
+//|                        has replaced in the new one
+//| and decides when the replaced nodes may be freed.
+//////////////////////////////////////////////////////////////////
+template <typename Derived, typename Node, typename Compare>
+class _RBCow_core {
+public:
+  using key_compare = Compare;
+
+  key_compare key_comp() const
+  { return comp_; }
+
+protected:
+  using pointer = Node *;
+
+  // a red-black tree of n nodes is at most 2 log2(n + 1) high
+  static constexpr int _Max_depth = 2 * 64;
+  // bound on the nodes one write replaces: the path and the
+  // siblings and nephews recolored by the fixups
+  static constexpr int _Max_replaced = 4 * _Max_depth + 8;
+
+  explicit _RBCow_core(const Compare &comp) :
+    comp_(comp), stamp_(0)
+  { }
+
+  template <typename K>
+  pointer _Find(pointer node, const K &key) const
+  { // node of any version whose key is equivalent to key
+    while (node != nullptr) {
+      if (comp_(key, node->key_))
+        node = node->left_;
+      else if (comp_(node->key_, key))
+        node = node->right_;
+      else
+        return node;
+    }
+    return nullptr;
+  }
+
+  template <typename K, typename Fn>
+  void _Range(pointer node, const K &lo, const K &hi, Fn &fn) const
+  { // calls fn(key, data) for the keys in [lo, hi) in order
+    pointer stack[_Max_depth + 2];
+    int top = 0;
+    for (;;) {
+      while (node != nullptr) {
+        if (comp_(node->key_, lo))
+          node = node->right_;
+        else {
+          stack[top++] = node;
+          node = node->left_;
+        }
+      }
+      if (top == 0)
+        return;
+      node = stack[--top];
+      if (!comp_(node->key_, hi))
+        return;
+      fn(static_cast<const decltype(node->key_) &>(node->key_),
+        static_cast<const decltype(node->data_) &>(node->data_));
+      node = node->right_;
+    }
+  }
+
+  template <typename K, typename D>
+  bool _Cow_insert(pointer &root, K &&key, D &&data, bool assign)
+  { // root becomes the root of the new version; true if a node was
+    // added, with assign the data of an existing key is replaced
+    pointer original = root;
+    _Begin_write();
+    try {
+      pointer path[_Max_depth + 2];
+      int depth = 0;
+      for (pointer node = root; node != nullptr; ) {
+        path[depth++] = node;
+        if (comp_(key, node->key_))
+          node = node->left_;
+        else if (comp_(node->key_, key))
+          node = node->right_;
+        else {
+          if (assign) {
+            _Own_path(root, path, depth);
+            path[depth - 1]->data_ = std::forward<D>(data);
+          }
+          return false;
+        }
+      }
+
+      _Own_path(root, path, depth);
+      pointer node = _Derived()._Create(std::forward<K>(key),
+        std::forward<D>(data));
+      if (depth == 0)
+        root = node;
+      else if (comp_(node->key_, path[depth - 1]->key_))
+        path[depth - 1]->left_ = node;
+      else
+        path[depth - 1]->right_ = node;
+      path[depth++] = node;
+      _Fix_insert(root, path, depth);
+      return true;
+    }
+    catch (...) {
+      _Rollback(root, original);
+      throw;
+    }
+  }
+
+  template <typename K>
+  bool _Cow_erase(pointer &root, const K &key)
+  { // root becomes the root of the new version; true if key was
+    // found. A node with two children takes the element of its
+    // successor, which is removed instead
+    pointer original = root;
+    _Begin_write();
+    try {
+      pointer path[_Max_depth + 3];
+      int depth = 0, found = -1;
+      for (pointer node = root; node != nullptr && found < 0; ) {
+        path[depth++] = node;
+        if (comp_(key, node->key_))
+          node = node->left_;
+        else if (comp_(node->key_, key))
+          node = node->right_;
+        else
+          found = depth - 1;
+      }
+      if (found < 0)
+        return false;
+      if (path[found]->left_ != nullptr && path[found]->right_ != nullptr)
+        for (pointer node = path[found]->right_; node != nullptr;
+          node = node->left_)
+          path[depth++] = node;
+
+      _Own_path(root, path, depth);
+      pointer removed = path[depth - 1];
+      if (depth - 1 != found) {
+        path[found]->key_ = std::move(removed->key_);
+        path[found]->data_ = std::move(removed->data_);
+      }
+
+      pointer child = removed->left_ != nullptr ?
+        removed->left_ : removed->right_;
+      _Link_of(root, path, depth - 1) = child;
+      depth--;
+      Color color = removed->color_;
+      _Derived()._Destroy_node(removed);
+      if (color == BLACK)
+        _Fix_erase(root, path, depth, child);
+      if (_Is_red(root))
+        _Own(root)->color_ = BLACK;
+      return true;
+    }
+    catch (...) {
+      _Rollback(root, original);
+      throw;
+    }
+  }
+
+  template <typename Fn>
+  void _For_fresh(pointer root, Fn fn)
+  { // calls fn(node) for every node made by the last write; they
+    // hang together from the root. Children are read before fn
+    // runs, so fn may free the node
+    pointer stack[2 * _Max_depth + 4];
+    int top = 0;
+    if (_Fresh(root))
+      stack[top++] = root;
+    while (top > 0) {
+      pointer node = stack[--top];
+      if (_Fresh(node->left_))
+        stack[top++] = node->left_;
+      if (_Fresh(node->right_))
+        stack[top++] = node->right_;
+      fn(node);
+    }
+  }
+
+  __ bool _Fresh(pointer node) const
+  { // made by the write in progress, so it may still change
+    return node != nullptr && node->stamp_ == stamp_;
+  }
+
+  Compare comp_;
+  std::uint64_t stamp_;
+
+private:
+  Derived &_Derived()
+  { return static_cast<Derived &>(*this); }
+
+  __ void _Begin_write()
+  { // every node of the tree is older than the new stamp
+    ++stamp_;
+  }
+
+  void _Rollback(pointer &root, pointer original)
+  { // a write threw: free what it made, the old version is intact
+    _For_fresh(root, [this](pointer node) { _Derived()._Destroy_node(node); });
+    root = original;
+  }
+
+  pointer _Own(pointer &link)
+  { // makes the node at link writable, copying it if an older
+    // version may see it; the copy takes its place in the link
+    if (!_Fresh(link)) {
+      pointer old = link;
+      link = _Derived()._Copy(old);
+      _Derived()._Replaced(old);
+    }
+    return link;
+  }
+
+  __ static pointer &_Link_of(pointer &root, pointer *path, int index)
+  { // the link that points to path[index]
+    if (index == 0)
+      return root;
+    pointer parent = path[index - 1];
+    return parent->left_ == path[index] ? parent->left_ : parent->right_;
+  }
+
+  void _Own_path(pointer &root, pointer *path, int depth)
+  { // copies the search path top down, each copy linked into the
+    // copy of its parent
+    for (int i = 0; i < depth; i++)
+      path[i] = _Own(_Link_of(root, path, i));
+  }
+
+  __ static bool _Is_red(pointer node)
+  { return node != nullptr && node->color_ == RED; }
+
+  __ static pointer _Rotate_left(pointer &link)
+  { // both link's node and its right child must be writable
+    pointer node = link, pivot = node->right_;
+    node->right_ = pivot->left_;
+    pivot->left_ = node;
+    link = pivot;
+    return pivot;
+  }
+
+  __ static pointer _Rotate_right(pointer &link)
+  {
+    pointer node = link, pivot = node->left_;
+    node->left_ = pivot->right_;
+    pivot->right_ = node;
+    link = pivot;
+    return pivot;
+  }
+
+  void _Fix_insert(pointer &root, pointer *path, int depth)
+  { // CLRS insertion fixup, parents taken from the path; the
+    // path is writable, uncles are copied before recoloring
+    int i = depth - 1;
+    while (i >= 2 && _Is_red(path[i - 1])) {
+      pointer node = path[i], parent = path[i - 1], grand = path[i - 2];
+      if (parent == grand->left_) {
+        if (_Is_red(grand->right_)) {
+          _Own(grand->right_)->color_ = BLACK;
+          parent->color_ = BLACK;
+          grand->color_ = RED;
+          i -= 2;
+          continue;
+        }
+        if (node == parent->right_)
+          parent = _Rotate_left(grand->left_);
+        parent->color_ = BLACK;
+        grand->color_ = RED;
+        _Rotate_right(_Link_of(root, path, i - 2));
+      }
+      else {
+        if (_Is_red(grand->left_)) {
+          _Own(grand->left_)->color_ = BLACK;
+          parent->color_ = BLACK;
+          grand->color_ = RED;
+          i -= 2;
+          continue;
+        }
+        if (node == parent->left_)
+          parent = _Rotate_right(grand->right_);
+        parent->color_ = BLACK;
+        grand->color_ = RED;
+        _Rotate_left(_Link_of(root, path, i - 2));
+      }
+      break;
+    }
+    root->color_ = BLACK;
+  }
+
+  void _Fix_erase(pointer &root, pointer *path, int depth, pointer node)
+  { // CLRS deletion fixup: node (maybe nil[T]) carries an extra
+    // black and its parent is path[depth - 1]. Siblings and their
+    // children are copied before they change; a rotation at the
+    // parent pushes the old sibling onto the path above it
+    while (depth > 0 && !_Is_red(node)) {
+      pointer parent = path[depth - 1];
+      if (node == parent->left_) {
+        pointer sibling = _Own(parent->right_);
+        if (sibling->color_ == RED) { // case 1
+          sibling->color_ = BLACK;
+          parent->color_ = RED;
+          _Rotate_left(_Link_of(root, path, depth - 1));
+          path[depth - 1] = sibling;
+          path[depth++] = parent;
+          sibling = _Own(parent->right_);
+        }
+        if (!_Is_red(sibling->left_) && !_Is_red(sibling->right_)) {
+          sibling->color_ = RED; // case 2
+          node = parent;
+          depth--;
+          continue;
+        }
+        if (!_Is_red(sibling->right_)) { // case 3
+          _Own(sibling->left_)->color_ = BLACK;
+          sibling->color_ = RED;
+          sibling = _Rotate_right(parent->right_);
+        }
+        sibling->color_ = parent->color_; // case 4
+        parent->color_ = BLACK;
+        _Own(sibling->right_)->color_ = BLACK;
+        _Rotate_left(_Link_of(root, path, depth - 1));
+      }
+      else {
+        pointer sibling = _Own(parent->left_);
+        if (sibling->color_ == RED) {
+          sibling->color_ = BLACK;
+          parent->color_ = RED;
+          _Rotate_right(_Link_of(root, path, depth - 1));
+          path[depth - 1] = sibling;
+          path[depth++] = parent;
+          sibling = _Own(parent->left_);
+        }
+        if (!_Is_red(sibling->left_) && !_Is_red(sibling->right_)) {
+          sibling->color_ = RED;
+          node = parent;
+          depth--;
+          continue;
+        }
+        if (!_Is_red(sibling->left_)) {
+          _Own(sibling->right_)->color_ = BLACK;
+          sibling->color_ = RED;
+          sibling = _Rotate_left(parent->left_);
+        }
+        sibling->color_ = parent->color_;
+        parent->color_ = BLACK;
+        _Own(sibling->left_)->color_ = BLACK;
+        _Rotate_right(_Link_of(root, path, depth - 1));
+      }
+      return;
+    }
+    if (_Is_red(node)) {
+      pointer &link = depth == 0 ? root :
+        path[depth - 1]->left_ == node ? path[depth - 1]->left_ :
+        path[depth - 1]->right_;
+      _Own(link)->color_ = BLACK;
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,416 @@
+#ifndef RBTREE_FROZEN_H_
+#define RBTREE_FROZEN_H_
+
+#include "rbtree.h"
+
+//////////////////////////////////////////////////////////////////
+//| _RBAligned_allocator
+//|
+//| std::allocator aligned to Align bytes, so that the arrays of
+//| FrozenRBTree start on a cache line.
+//////////////////////////////////////////////////////////////////
+template <typename T, std::size_t Align>
+class _RBAligned_allocator {
+public:
+  using value_type = T;
+
+  template <typename U>
+  struct rebind { using other = _RBAligned_allocator<U, Align>; };
+
+  _RBAligned_allocator() noexcept = default;
+
+  template <typename U>
+  _RBAligned_allocator(const _RBAligned_allocator<U, Align> &) noexcept
+  { }
+
+  T *allocate(std::size_t n)
+  {
+    return static_cast<T *>(::operator new(n * sizeof(T),
+      std::align_val_t(Align)));
+  }
+
+  void deallocate(T *p, std::size_t) noexcept
+  {
+    ::operator delete(p, std::align_val_t(Align));
+  }
+
+  template <typename U>
+  bool operator==(const _RBAligned_allocator<U, Align> &) const noexcept
+  { return true; }
+
+  template <typename U>
+  bool operator!=(const _RBAligned_allocator<U, Align> &) const noexcept
+  { return false; }
+};
+
+//////////////////////////////////////////////////////////////////
+//| FrozenRBTree
+//|
+//| immutable, read-optimized copy of an RBTree, made by freeze().
+//| The keys are stored in Eytzinger order, the breadth-first order
+//| of a complete binary tree: the children of slot k are 2k and
+//| 2k + 1, so a descent needs no pointers and the top levels share
+//| a few cache lines. The data sit in a parallel array, read only
+//| once the key is found.
+//| A descent makes the same number of steps for every key, taking
+//| the comparison as the next bit of the slot (no branch), and
+//| prefetches the cache line holding the descendants four levels
+//| below (for 4-byte keys). The trailing right turns are then
+//| stripped to get the lower bound.
+//|   RBTree<int, int> tree;
+//|   ...
+//|   FrozenRBTree<int, int> frozen = tree.freeze(); // O(n)
+//|   auto it = frozen.search(42);
+//| search, lower_bound, upper_bound, equal_range, for_each_in_range,
+//| search_batch and the iterators work as in RBTree.
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType, typename Compare>
+class FrozenRBTree {
+  // slots per cache line: the descendants of slot k that many
+  // levels down are slots k * _Stride ... k * _Stride + _Stride - 1
+  static constexpr std::size_t _Line = 64;
+  static constexpr std::size_t _Stride =
+    sizeof(KeyType) >= _Line ? 1 : _Line / sizeof(KeyType);
+
+  class _Reference;
+  class _Iterator;
+
+public:
+  using size_type = std::size_t;
+  using key_compare = Compare;
+  using iterator = _Iterator;
+  using const_iterator = _Iterator;
+
+  explicit FrozenRBTree(const Compare &comp = Compare()) :
+    comp_(comp), size_(0), levels_(0)
+  { }
+
+  template <typename Allocator, typename Traits>
+  explicit FrozenRBTree(
+    const RBTree<KeyType, DataType, Compare, Allocator, Traits> &tree) :
+    comp_(tree.key_comp()), size_(0), levels_(0)
+  {
+    rebuild(tree);
+  }
+
+  template <typename Allocator, typename Traits>
+  void rebuild(const RBTree<KeyType, DataType, Compare, Allocator, Traits> &tree)
+  { // lays out the elements of tree again, in O(n). An in-order
+    // walk of the implicit tree visits the slots in key order, so
+    // one walk of tree alongside it puts every element in place
+    size_type size = tree.size();
+    decltype(keys_) keys;
+    decltype(data_) data;
+    if constexpr (std::is_default_constructible<KeyType>::value &&
+      std::is_default_constructible<DataType>::value) {
+      keys.resize(size + 1);
+      data.resize(size + 1);
+      size_type slot = _Leftmost(size);
+      for (auto it = tree.cbegin(); it != tree.cend();
+        ++it, slot = _Next(slot, size)) {
+        keys[slot] = (*it).Key();
+        data[slot] = (*it).Data();
+      }
+    }
+    else { // slots must be built in order: the elements are gathered
+      // by the rank of each slot instead
+      using tree_iterator = typename RBTree<KeyType, DataType, Compare,
+        Allocator, Traits>::const_iterator;
+      std::vector<tree_iterator> sorted;
+      sorted.reserve(size);
+      for (auto it = tree.cbegin(); it != tree.cend(); ++it)
+        sorted.push_back(it);
+      std::vector<size_type> rank(size + 1);
+      size_type slot = _Leftmost(size);
+      for (size_type r = 0; r < size; r++, slot = _Next(slot, size))
+        rank[slot] = r;
+      keys.reserve(size + 1);
+      data.reserve(size + 1);
+      if (size > 0) { // slot 0 is never read
+        keys.push_back((*sorted[0]).Key());
+        data.push_back((*sorted[0]).Data());
+      }
+      for (size_type k = 1; k <= size; k++) {
+        keys.push_back((*sorted[rank[k]]).Key());
+        data.push_back((*sorted[rank[k]]).Data());
+      }
+    }
+    keys_.swap(keys);
+    data_.swap(data);
+    comp_ = tree.key_comp();
+    size_ = size;
+    levels_ = 0;
+    while ((size >> levels_) != 0)
+      levels_++;
+  }
+
+  size_type size() const
+  { return size_; }
+
+  bool empty() const
+  { return size_ == 0; }
+
+  key_compare key_comp() const
+  { return comp_; }
+
+  template <typename K>
+  const_iterator search(const K &key) const
+  {
+    size_type slot = _Lower_bound(key);
+    if (slot != 0 && comp_(key, keys_[slot]))
+      slot = 0;
+    return const_iterator(this, slot);
+  }
+
+  template <typename K>
+  const_iterator lower_bound(const K &key) const
+  { return const_iterator(this, _Lower_bound(key)); }
+
+  template <typename K>
+  const_iterator upper_bound(const K &key) const
+  { return const_iterator(this, _Upper_bound(key)); }
+
+  template <typename K>
+  std::pair<const_iterator, const_iterator> equal_range(const K &key) const
+  { // elements with key equivalent to key; a frozen copy of a tree
+    // without unique keys keeps its duplicates
+    return std::make_pair(lower_bound(key), upper_bound(key));
+  }
+
+  template <typename K, typename Fn>
+  void for_each_in_range(const K &lo, const K &hi, Fn &&fn) const
+  { // calls fn(key, data) for every element with key in [lo, hi)
+    for (size_type slot = _Lower_bound(lo);
+      slot != 0 && comp_(keys_[slot], hi); slot = _Next(slot, size_))
+      fn(keys_[slot], data_[slot]);
+  }
+
+  // batched lookup as in RBTree::search_batch: the descents of a
+  // group run in lockstep, all of the same length, with no branch
+  // in the loop over the lanes
+  template <typename ForwardIt, typename OutputIt>
+  OutputIt search_batch(ForwardIt first, ForwardIt last, OutputIt out) const
+  {
+    using K = std::decay_t<decltype(*first)>;
+    constexpr int lanes = 16;
+    const K *keys[lanes];
+    size_type slot[lanes];
+    while (first != last) {
+      int count = 0;
+      for (; count < lanes && first != last; ++first, count++) {
+        keys[count] = std::addressof(*first);
+        slot[count] = 1;
+      }
+      for (int level = 0; level < levels_; level++)
+        for (int i = 0; i < count; i++)
+          slot[i] = _Step(slot[i], *keys[i]);
+      for (int i = 0; i < count; i++) {
+        size_type found = _Strip(slot[i]);
+        if (found != 0 && comp_(*keys[i], keys_[found]))
+          found = 0;
+        *out++ = const_iterator(this, found);
+      }
+    }
+    return out;
+  }
+
+  template <typename Keys, typename OutputIt>
+  OutputIt search_batch(const Keys &keys, OutputIt out) const
+  { return search_batch(std::begin(keys), std::end(keys), out); }
+
+  const_iterator begin() const
+  { return const_iterator(this, _Leftmost(size_)); }
+
+  const_iterator end() const
+  { return const_iterator(this, 0); }
+
+  const_iterator cbegin() const
+  { return begin(); }
+
+  const_iterator cend() const
+  { return end(); }
+
+private:
+  // the element at an iterator, with the Key() and Data() of RBNode
+  class _Reference {
+  public:
+    _Reference(const KeyType &key, const DataType &data) :
+      key_(key), data_(data)
+    { }
+
+    const KeyType &Key() const {
+      return key_;
+    }
+
+    const DataType &Data() const {
+      return data_;
+    }
+
+    const _Reference *operator->() const
+    { return this; }
+
+  private:
+    const KeyType &key_;
+    const DataType &data_;
+  };
+
+  class _Iterator {
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using value_type = _Reference;
+    using difference_type = std::ptrdiff_t;
+    using reference = _Reference;
+    using pointer = _Reference;
+
+    _Iterator() :
+      tree_(nullptr), slot_(0)
+    { }
+
+    _Iterator(const FrozenRBTree *tree, size_type slot) :
+      tree_(tree), slot_(slot)
+    { }
+
+    reference operator*() const
+    { return _Reference(tree_->keys_[slot_], tree_->data_[slot_]); }
+
+    pointer operator->() const
+    { return **this; }
+
+    _Iterator &operator++()
+    {
+      if (slot_ != 0)
+        slot_ = _Next(slot_, tree_->size_);
+      return *this;
+    }
+
+    _Iterator operator++(int)
+    {
+      _Iterator old = *this;
+      ++(*this);
+      return old;
+    }
+
+    _Iterator &operator--()
+    { // end() steps to the maximum
+      slot_ = slot_ == 0 ? _Rightmost(tree_->size_) :
+        _Prev(slot_, tree_->size_);
+      return *this;
+    }
+
+    _Iterator operator--(int)
+    {
+      _Iterator old = *this;
+      --(*this);
+      return old;
+    }
+
+    bool operator==(const _Iterator &rhs) const
+    { return slot_ == rhs.slot_; }
+
+    bool operator!=(const _Iterator &rhs) const
+    { return slot_ != rhs.slot_; }
+
+  private:
+    const FrozenRBTree *tree_;
+    size_type slot_;
+  };
+
+  template <typename K>
+  __ size_type _Step(size_type slot, const K &key) const
+  { // one level of the lower bound descent. Past the last level the
+    // step turns right without reading, so every descent has the
+    // same length and _Strip still finds the bound
+    _RBPrefetch(keys_.data() + std::min(slot * _Stride, size_));
+    size_type read = slot <= size_ ? slot : size_;
+    bool right = comp_(keys_[read], key) | (slot > size_);
+    return 2 * slot + right;
+  }
+
+  template <typename K>
+  size_type _Lower_bound(const K &key) const
+  { // first slot whose key is not less than key, 0 if none
+    size_type slot = 1;
+    for (int level = 0; level < levels_; level++)
+      slot = _Step(slot, key);
+    return _Strip(slot);
+  }
+
+  template <typename K>
+  size_type _Upper_bound(const K &key) const
+  { // first slot whose key is greater than key, 0 if none
+    size_type slot = 1;
+    for (int level = 0; level < levels_; level++) {
+      _RBPrefetch(keys_.data() + std::min(slot * _Stride, size_));
+      size_type read = slot <= size_ ? slot : size_;
+      bool right = !comp_(key, keys_[read]) | (slot > size_);
+      slot = 2 * slot + right;
+    }
+    return _Strip(slot);
+  }
+
+  __ static size_type _Strip(size_type slot)
+  { // the bits of slot below the root's are the turns taken, 1 for
+    // right; the bound is where the last left turn was made
+#if defined(__GNUC__) || defined(__clang__)
+    return slot >> (__builtin_ctzll(~static_cast<unsigned long long>(slot)) + 1);
+#else
+    while (slot & 1)
+      slot >>= 1;
+    return slot >> 1;
+#endif
+  }
+
+  __ static size_type _Leftmost(size_type size)
+  {
+    if (size == 0)
+      return 0;
+    size_type slot = 1;
+    while (2 * slot <= size)
+      slot *= 2;
+    return slot;
+  }
+
+  __ static size_type _Rightmost(size_type size)
+  {
+    if (size == 0)
+      return 0;
+    size_type slot = 1;
+    while (2 * slot + 1 <= size)
+      slot = 2 * slot + 1;
+    return slot;
+  }
+
+  static size_type _Next(size_type slot, size_type size)
+  { // in-order successor in the implicit tree, 0 after the maximum
+    if (2 * slot + 1 <= size) {
+      slot = 2 * slot + 1;
+      while (2 * slot <= size)
+        slot *= 2;
+      return slot;
+    }
+    while (slot & 1)
+      slot >>= 1;
+    return slot >> 1;
+  }
+
+  static size_type _Prev(size_type slot, size_type size)
+  { // in-order predecessor, 0 before the minimum
+    if (2 * slot <= size) {
+      slot = 2 * slot;
+      while (2 * slot + 1 <= size)
+        slot = 2 * slot + 1;
+      return slot;
+    }
+    while (slot != 0 && !(slot & 1))
+      slot >>= 1;
+    return slot >> 1;
+  }
+
+  std::vector<KeyType, _RBAligned_allocator<KeyType, _Line>> keys_;
+  std::vector<DataType> data_;
+  Compare comp_;
+  size_type size_;
+  int levels_; // levels of the implicit tree
+};
+
+#endif
@@ -0,0 +1,247 @@
+#ifndef RBTREE_PERSISTENT_H_
+#define RBTREE_PERSISTENT_H_
+
+#include "rbtree_cow.h"
+
+//////////////////////////////////////////////////////////////////
+//| RBPersistentTree
+//|
+//| ordered map with value semantics whose versions share nodes.
+//| insert and erase copy only the O(log n) nodes they change (see
+//| _RBCow_core), so copying a tree, or calling snapshot(), costs
+//| O(1) and later writes to either copy leave the other alone.
+//| A node counts the parents and trees that point to it; when the
+//| last one lets go, it is freed and lets go of its children.
+//| Counts are atomic, so versions may be read and dropped on other
+//| threads while the tree they came from goes on changing; one
+//| version must not be written by two threads at once. With
+//| RBPoolAllocator all versions share one pool, which is not thread
+//| safe, so the versions must then stay on one thread.
+//|   RBPersistentTree<int, std::string> tree;
+//|   tree.insert(1, "one");
+//|   auto view = tree.snapshot();        // O(1)
+//|   tree.erase(1);                      // view still holds 1
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType,
+  typename Compare = std::less<KeyType>,
+  typename Allocator = std::allocator<std::pair<const KeyType, DataType>>>
+class RBPersistentTree : private _RBCow_core<
+  RBPersistentTree<KeyType, DataType, Compare, Allocator>,
+  _RBCow_node<KeyType, DataType, true>, Compare> {
+  using _Base = _RBCow_core<RBPersistentTree,
+    _RBCow_node<KeyType, DataType, true>, Compare>;
+  friend _Base;
+
+public:
+  using NodeType = _RBCow_node<KeyType, DataType, true>;
+  using pointer = NodeType *;
+  using size_type = std::size_t;
+  using key_compare = Compare;
+  using allocator_type = Allocator;
+
+  explicit RBPersistentTree(const Compare &comp = Compare(),
+    const Allocator &alloc = Allocator()) :
+    _Base(comp), root_(nullptr), size_(0), alloc_(alloc)
+  { }
+
+  RBPersistentTree(const RBPersistentTree &rhs) :
+    _Base(rhs), root_(rhs.root_), size_(rhs.size_), alloc_(rhs.alloc_)
+  { // shares every node of rhs; the allocator is shared as well,
+    // since either tree may free the nodes
+    _Acquire(root_);
+  }
+
+  RBPersistentTree(RBPersistentTree &&rhs) noexcept :
+    _Base(rhs), root_(rhs.root_), size_(rhs.size_), alloc_(rhs.alloc_)
+  {
+    rhs.root_ = nullptr;
+    rhs.size_ = 0;
+  }
+
+  RBPersistentTree &operator=(RBPersistentTree rhs) noexcept
+  { // copy or move, then swap: the old version is let go
+    swap(rhs);
+    return *this;
+  }
+
+  ~RBPersistentTree()
+  {
+    _Release(root_);
+  }
+
+  void swap(RBPersistentTree &rhs) noexcept
+  {
+    using std::swap;
+    swap(this->comp_, rhs.comp_);
+    swap(this->stamp_, rhs.stamp_);
+    swap(root_, rhs.root_);
+    swap(size_, rhs.size_);
+    swap(alloc_, rhs.alloc_);
+  }
+
+  RBPersistentTree snapshot() const
+  { // the current version, in O(1)
+    return *this;
+  }
+
+  using _Base::key_comp;
+
+  allocator_type get_allocator() const
+  { return allocator_type(alloc_); }
+
+  template <typename K>
+  const DataType *search(const K &key) const
+  { // data for key, or nullptr; valid while some version holds it
+    pointer node = this->_Find(root_, key);
+    return node == nullptr ? nullptr : &node->Data();
+  }
+
+  template <typename K>
+  bool contains(const K &key) const
+  { return this->_Find(root_, key) != nullptr; }
+
+  template <typename K, typename Fn>
+  void for_each_in_range(const K &lo, const K &hi, Fn fn) const
+  { // calls fn(key, data) for every key in [lo, hi)
+    this->_Range(root_, lo, hi, fn);
+  }
+
+  size_type size() const
+  { return size_; }
+
+  bool empty() const
+  { return root_ == nullptr; }
+
+  template <typename K, typename D>
+  bool insert(K &&key, D &&data)
+  { // adds key unless present; true if it was added
+    pointer root = root_;
+    bool inserted = this->_Cow_insert(root, std::forward<K>(key),
+      std::forward<D>(data), false);
+    _Commit(root);
+    size_ += inserted;
+    return inserted;
+  }
+
+  template <typename K, typename D>
+  bool insert_or_assign(K &&key, D &&data)
+  { // adds key or replaces its data; true if it was added
+    pointer root = root_;
+    bool inserted = this->_Cow_insert(root, std::forward<K>(key),
+      std::forward<D>(data), true);
+    _Commit(root);
+    size_ += inserted;
+    return inserted;
+  }
+
+  template <typename K>
+  bool erase(const K &key)
+  { // true if key was present
+    pointer root = root_;
+    bool erased = this->_Cow_erase(root, key);
+    _Commit(root);
+    size_ -= erased;
+    return erased;
+  }
+
+  void clear()
+  { // lets go of the current version
+    _Release(root_);
+    root_ = nullptr;
+    size_ = 0;
+  }
+
+private:
+  using node_allocator = typename std::allocator_traits<Allocator>::
+    template rebind_alloc<NodeType>;
+  using node_traits = std::allocator_traits<node_allocator>;
+
+  __ static void _Acquire(pointer node)
+  {
+    if (node != nullptr)
+      node->refs_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void _Commit(pointer root)
+  { // root is the new version. Its fresh nodes start with the one
+    // reference of their parent (or of the tree); the older nodes
+    // they point to gain one each. Then the old version is let go
+    if (root == root_)
+      return;
+    this->_For_fresh(root, [this](pointer node) {
+      if (!this->_Fresh(node->left_))
+        _Acquire(node->left_);
+      if (!this->_Fresh(node->right_))
+        _Acquire(node->right_);
+    });
+    _Release(root_);
+    root_ = root;
+  }
+
+  void _Release(pointer node)
+  { // drops one reference to node; the last one frees it and drops
+    // the references it holds to its children
+    pointer stack[_Base::_Max_depth + 2];
+    int top = 0;
+    if (node != nullptr)
+      stack[top++] = node;
+    while (top > 0) {
+      node = stack[--top];
+      if (node->refs_.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        continue;
+      if (node->left_ != nullptr)
+        stack[top++] = node->left_;
+      if (node->right_ != nullptr)
+        stack[top++] = node->right_;
+      _Destroy_node(node);
+    }
+  }
+
+  // hooks of _RBCow_core
+
+  template <typename... Args>
+  pointer _Allocate(Args&&... args)
+  {
+    pointer node = node_traits::allocate(alloc_, 1);
+    try {
+      node_traits::construct(alloc_, node, this->stamp_,
+        std::forward<Args>(args)...);
+    }
+    catch (...) {
+      node_traits::deallocate(alloc_, node, 1);
+      throw;
+    }
+    return node;
+  }
+
+  template <typename K, typename D>
+  pointer _Create(K &&key, D &&data)
+  { return _Allocate(std::forward<K>(key), std::forward<D>(data)); }
+
+  pointer _Copy(pointer node)
+  { return _Allocate(*node); }
+
+  void _Destroy_node(pointer node)
+  {
+    node_traits::destroy(alloc_, node);
+    node_traits::deallocate(alloc_, node, 1);
+  }
+
+  __ void _Replaced(pointer)
+  { // older versions still count it, nothing to do
+  }
+
+  pointer root_;
+  size_type size_;
+  node_allocator alloc_;
+};
+
+template <typename KeyType, typename DataType, typename Compare,
+  typename Allocator>
+void swap(RBPersistentTree<KeyType, DataType, Compare, Allocator> &lhs,
+  RBPersistentTree<KeyType, DataType, Compare, Allocator> &rhs) noexcept
+{
+  lhs.swap(rhs);
+}
+
+#endif
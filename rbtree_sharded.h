@@ -0,0 +1,363 @@
+#ifndef RBTREE_SHARDED_H_
+#define RBTREE_SHARDED_H_
+
+#include "rbtree.h"
+
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <shared_mutex>
+
+// tag selecting the ShardedRBTree constructor that partitions keys
+// by range instead of by hash
+struct RBRangeShardsTag {
+  explicit RBRangeShardsTag() = default;
+};
+constexpr RBRangeShardsTag RBRangeShards{};
+
+//////////////////////////////////////////////////////////////////
+//| ShardedRBTree
+//|
+//| concurrent ordered map made of several RBTree shards, each with
+//| its own lock and its own copy of the allocator (a fresh pool
+//| with RBPoolAllocator), padded to a cache line so that threads
+//| working on different shards never share one. Keys go to a shard
+//| by hash, which spreads point operations evenly, or by range,
+//| which keeps every shard a contiguous piece of the key order.
+//| Ordered scans merge the shards; range shards are merged by
+//| visiting them in order. Range boundaries move with rebalance(),
+//| one boundary at a time while other operations go on.
+//|   ShardedRBTree<int, std::string> tree(16);            // by hash
+//|   ShardedRBTree<int, std::string> ranges(RBRangeShards,
+//|     std::vector<int>{ 1000, 2000, 3000 });             // 4 shards
+//| Callbacks run under shard locks and must not call back into the
+//| same tree.
+//////////////////////////////////////////////////////////////////
+template <typename KeyType, typename DataType,
+  typename Compare = std::less<KeyType>,
+  typename Allocator = RBPoolAllocator<std::pair<const KeyType, DataType>>,
+  typename Traits = RBTreeTraits,
+  typename Hash = std::hash<KeyType>>
+class ShardedRBTree {
+public:
+  using tree_type = RBTree<KeyType, DataType, Compare, Allocator, Traits>;
+  using size_type = typename tree_type::size_type;
+  using key_compare = Compare;
+  using allocator_type = Allocator;
+
+  explicit ShardedRBTree(size_type shards =
+    std::max(1u, std::thread::hardware_concurrency()),
+    const Compare &comp = Compare(), const Allocator &alloc = Allocator()) :
+    comp_(comp), ranged_(false)
+  { // hash sharding
+    _Make_shards(std::max<size_type>(shards, 1), alloc);
+  }
+
+  ShardedRBTree(RBRangeShardsTag, std::vector<KeyType> bounds,
+    const Compare &comp = Compare(), const Allocator &alloc = Allocator()) :
+    comp_(comp), ranged_(true), bounds_(std::move(bounds))
+  { // range sharding: bounds, increasing, are the least keys of the
+    // shards after the first, so there is one shard more than bounds
+    _Make_shards(bounds_.size() + 1, alloc);
+  }
+
+  ShardedRBTree(const ShardedRBTree &) = delete;
+  ShardedRBTree &operator=(const ShardedRBTree &) = delete;
+
+  size_type shard_count() const
+  { return shards_.size(); }
+
+  key_compare key_comp() const
+  { return comp_; }
+
+  template <typename D>
+  bool insert(const KeyType &key, D &&data)
+  { // adds key unless present; true if it was added
+    auto route = _Route_lock();
+    _Shard &shard = _Shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    return shard.tree_.try_emplace(key, std::forward<D>(data)).second;
+  }
+
+  template <typename D>
+  bool insert_or_assign(const KeyType &key, D &&data)
+  { // adds key or replaces its data; true if it was added
+    auto route = _Route_lock();
+    _Shard &shard = _Shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    return shard.tree_.insert_or_assign(key, std::forward<D>(data)).second;
+  }
+
+  bool erase(const KeyType &key)
+  { // true if key was present
+    auto route = _Route_lock();
+    _Shard &shard = _Shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    auto it = shard.tree_.search(key);
+    if (it == shard.tree_.end())
+      return false;
+    shard.tree_.erase(it);
+    return true;
+  }
+
+  std::optional<DataType> search(const KeyType &key) const
+  { // copy of the data for key, if present
+    auto route = _Route_lock();
+    const _Shard &shard = _Shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    auto it = shard.tree_.search(key);
+    if (it == shard.tree_.cend())
+      return std::nullopt;
+    return (*it).Data();
+  }
+
+  bool contains(const KeyType &key) const
+  {
+    auto route = _Route_lock();
+    const _Shard &shard = _Shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    return shard.tree_.search(key) != shard.tree_.cend();
+  }
+
+  template <typename Fn>
+  bool update(const KeyType &key, Fn fn)
+  { // calls fn(data) on the data for key under the shard's lock;
+    // false if absent
+    auto route = _Route_lock();
+    _Shard &shard = _Shard_of(key);
+    std::lock_guard<std::mutex> lock(shard.lock_);
+    auto it = shard.tree_.search(key);
+    if (it == shard.tree_.end())
+      return false;
+    shard.tree_.modify(it, fn);
+    return true;
+  }
+
+  size_type size() const
+  { // sum of the shard sizes, each read under its lock
+    auto route = _Route_lock();
+    size_type size = 0;
+    for (const _Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.lock_);
+      size += shard.tree_.size();
+    }
+    return size;
+  }
+
+  bool empty() const
+  { return size() == 0; }
+
+  void clear()
+  {
+    auto route = _Route_lock();
+    for (_Shard &shard : shards_) {
+      std::lock_guard<std::mutex> lock(shard.lock_);
+      shard.tree_.clear();
+    }
+  }
+
+  template <typename Fn>
+  void for_each(Fn fn) const
+  { // calls fn(key, data) for every element in key order, on a
+    // consistent view: all the shards are locked for the scan
+    auto route = _Route_lock();
+    auto locks = _Lock_all();
+    std::vector<_Cursor> cursors;
+    for (const _Shard &shard : shards_)
+      cursors.push_back({ shard.tree_.cbegin(), shard.tree_.cend() });
+    _Merge(cursors, fn);
+  }
+
+  template <typename Fn>
+  void for_each_in_range(const KeyType &lo, const KeyType &hi, Fn fn) const
+  { // calls fn(key, data) for every key in [lo, hi) in key order;
+    // range shards outside [lo, hi) are not looked at
+    if (!comp_(lo, hi))
+      return;
+    auto route = _Route_lock();
+    auto locks = _Lock_all();
+    std::vector<_Cursor> cursors;
+    size_type first = 0, last = shards_.size();
+    if (ranged_) {
+      first = _Range_shard(lo);
+      last = _Range_shard(hi) + 1;
+    }
+    for (size_type i = first; i < last; i++) {
+      const tree_type &tree = shards_[i].tree_;
+      auto end = tree.lower_bound(hi);
+      cursors.push_back({ tree.lower_bound(lo), end });
+    }
+    _Merge(cursors, fn);
+  }
+
+  void rebalance()
+  { // range sharding: moves the boundaries so the shards hold about
+    // the same number of elements. Each boundary moves on its own
+    // by a split and a concat, with routing stopped only meanwhile.
+    // Hash shards are balanced by the hash, nothing to do
+    if (!ranged_ || shards_.size() < 2)
+      return;
+    size_type total = size(), before = 0;
+    for (size_type i = 1; i < shards_.size(); i++) {
+      std::unique_lock<std::shared_mutex> route(route_);
+      size_type target = total * i / shards_.size();
+      _Move_boundary(i, target > before ? target - before : 0);
+      before += shards_[i - 1].tree_.size();
+    }
+  }
+
+private:
+  using const_iterator = typename tree_type::const_iterator;
+
+  struct alignas(64) _Shard {
+    _Shard(const Compare &comp, const Allocator &alloc) :
+      tree_(comp, alloc)
+    { }
+
+    mutable std::mutex lock_;
+    tree_type tree_;
+  };
+
+  struct _Cursor {
+    const_iterator it_;
+    const_iterator end_;
+  };
+
+  void _Make_shards(size_type count, const Allocator &alloc)
+  { // each shard gets the allocator a copied container would, so a
+    // pool is not shared between shards
+    for (size_type i = 0; i < count; i++)
+      shards_.emplace_back(comp_, std::allocator_traits<Allocator>::
+        select_on_container_copy_construction(alloc));
+  }
+
+  std::shared_lock<std::shared_mutex> _Route_lock() const
+  { // range boundaries can't move while held; hash routing is fixed
+    return ranged_ ? std::shared_lock<std::shared_mutex>(route_) :
+      std::shared_lock<std::shared_mutex>();
+  }
+
+  std::vector<std::unique_lock<std::mutex>> _Lock_all() const
+  { // always in shard order, so two scans can't deadlock
+    std::vector<std::unique_lock<std::mutex>> locks;
+    locks.reserve(shards_.size());
+    for (const _Shard &shard : shards_)
+      locks.emplace_back(shard.lock_);
+    return locks;
+  }
+
+  size_type _Range_shard(const KeyType &key) const
+  { // the number of boundaries not greater than key
+    return std::upper_bound(bounds_.begin(), bounds_.end(), key, comp_) -
+      bounds_.begin();
+  }
+
+  size_type _Hash_shard(const KeyType &key) const
+  { // spreads the hash over the shards with a multiply and a
+    // shift, which also mixes the identity hashes of integers
+    std::uint64_t hash = static_cast<std::uint64_t>(Hash()(key)) *
+      0x9E3779B97F4A7C15ull;
+    return static_cast<size_type>(((hash >> 32) * shards_.size()) >> 32);
+  }
+
+  _Shard &_Shard_of(const KeyType &key)
+  { return shards_[ranged_ ? _Range_shard(key) : _Hash_shard(key)]; }
+
+  const _Shard &_Shard_of(const KeyType &key) const
+  { return shards_[ranged_ ? _Range_shard(key) : _Hash_shard(key)]; }
+
+  template <typename Fn>
+  void _Merge(std::vector<_Cursor> &cursors, Fn &fn) const
+  { // k-way merge through a heap of the shards' next elements; range
+    // shards don't overlap and are taken one after the other
+    if (ranged_) {
+      for (_Cursor &cursor : cursors)
+        for (; cursor.it_ != cursor.end_; ++cursor.it_)
+          fn((*cursor.it_).Key(), (*cursor.it_).Data());
+      return;
+    }
+    auto later = [this](const _Cursor &a, const _Cursor &b) {
+      return comp_((*b.it_).Key(), (*a.it_).Key());
+    };
+    std::vector<_Cursor> heap;
+    for (_Cursor &cursor : cursors)
+      if (cursor.it_ != cursor.end_)
+        heap.push_back(cursor);
+    std::make_heap(heap.begin(), heap.end(), later);
+    while (!heap.empty()) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      _Cursor &cursor = heap.back();
+      fn((*cursor.it_).Key(), (*cursor.it_).Data());
+      if (++cursor.it_ == cursor.end_)
+        heap.pop_back();
+      else
+        std::push_heap(heap.begin(), heap.end(), later);
+    }
+  }
+
+  static KeyType _Key_at(const tree_type &tree, size_type index)
+  { // key of the index-th element, 0 <= index < size
+    if constexpr (Traits::order_statistics)
+      return (*tree.select(index)).Key();
+    else {
+      size_type size = tree.size();
+      if (index < size / 2)
+        return (*std::next(tree.cbegin(), index)).Key();
+      return (*std::prev(tree.cend(), size - index)).Key();
+    }
+  }
+
+  tree_type _Rehome(tree_type &&tree, const _Shard &shard)
+  { // tree with nodes from shard's allocator; concat keeps the
+    // allocator of its left tree and moves elements if it must
+    return tree_type::concat(tree_type(comp_, shard.tree_.get_allocator()),
+      std::move(tree));
+  }
+
+  void _Move_boundary(size_type i, size_type want)
+  { // gives shard i - 1 want elements, moving its tail to shard i
+    // or taking the heads of the shards after it; shards taken whole
+    // are left empty with their boundaries closed up. Routing must
+    // be stopped
+    tree_type &left = shards_[i - 1].tree_;
+    size_type have = left.size();
+    if (have > want) {
+      KeyType bound = _Key_at(left, want);
+      tree_type tail = left.split(bound);
+      tree_type &right = shards_[i].tree_;
+      right = tree_type::concat(_Rehome(std::move(tail), shards_[i]),
+        std::move(right));
+      bounds_[i - 1] = std::move(bound);
+      return;
+    }
+    size_type need = want - have, j = i;
+    while (need > 0 && j < bounds_.size() &&
+      need >= shards_[j].tree_.size()) {
+      need -= shards_[j].tree_.size();
+      left = tree_type::concat(std::move(left),
+        std::move(shards_[j].tree_));
+      j++;
+    }
+    // the last shard keeps an element, it has no boundary above
+    tree_type &right = shards_[j].tree_;
+    size_type take = right.empty() ? 0 : std::min(need, right.size() - 1);
+    if (take > 0) {
+      KeyType bound = _Key_at(right, take);
+      tree_type rest = right.split(bound);
+      left = tree_type::concat(std::move(left), std::move(right));
+      right = std::move(rest);
+      std::fill(bounds_.begin() + (i - 1), bounds_.begin() + j, bound);
+    }
+    else if (j > i)
+      std::fill(bounds_.begin() + (i - 1), bounds_.begin() + (j - 1),
+        bounds_[j - 1]);
+  }
+
+  Compare comp_;
+  bool ranged_;
+  std::vector<KeyType> bounds_;
+  mutable std::shared_mutex route_;
+  std::deque<_Shard> shards_;
+};
+
+#endif